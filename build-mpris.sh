@@ -1 +1 @@
-clang++ -std=gnu++23 -g -O3 $(pkg-config --cflags --libs playerctl) mpris.cpp -o mpris
\ No newline at end of file
+clang++ -std=gnu++23 -g -O3 $(pkg-config --cflags --libs playerctl freetype2 fribidi gdk-pixbuf-2.0) mpris.cpp -o mpris
\ No newline at end of file
@@ -1,88 +1,418 @@
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
+#include <charconv>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <expected>
+#include <fcntl.h>
 #include <limits>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <optional>
 #include <playerctl/playerctl.h>
+#include <gio/gio.h>
 #include <glib.h>
+#include <glib-unix.h>
 #include <iostream>
 #include <filesystem>
-#include <stdexcept>
+#include <ft2build.h>
+#include <fribidi/fribidi.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include FT_FREETYPE_H
+#include <functional>
 #include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utility>
 #include <string>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-template<typename T, typename... ArgsT>
-inline T handle_gfunc (T(*func)(ArgsT..., GError**), ArgsT... args) {
-    GError* err = nullptr;
-    T result = func(std::forward<ArgsT>(args)..., &err);
-    if (err != nullptr) {
-        throw std::runtime_error{err->message};
+// Per-type ownership rules for GHandle. The primary template covers GObject types.
+template <typename T>
+struct GHandleTraits {
+    static T* ref (T* p) { return static_cast<T*>(g_object_ref(p)); }
+    static void unref (T* p) { g_object_unref(p); }
+    // Floating references are sunk, so the handle always holds a full one.
+    static T* adopt (T* p) {
+        if (g_object_is_floating(p)) g_object_ref_sink(p);
+        return p;
+    }
+};
+
+template <>
+struct GHandleTraits<GVariant> {
+    static GVariant* ref (GVariant* p) { return g_variant_ref(p); }
+    static void unref (GVariant* p) { g_variant_unref(p); }
+    static GVariant* adopt (GVariant* p) { return g_variant_take_ref(p); }
+};
+
+template <>
+struct GHandleTraits<GError> {
+    static GError* ref (GError* p) { return g_error_copy(p); }
+    static void unref (GError* p) { g_error_free(p); }
+    static GError* adopt (GError* p) { return p; }
+};
+
+// Owns the list nodes only, not the elements.
+template <>
+struct GHandleTraits<GList> {
+    static GList* ref (GList* p) { return g_list_copy(p); }
+    static void unref (GList* p) { g_list_free(p); }
+    static GList* adopt (GList* p) { return p; }
+};
+
+template <>
+struct GHandleTraits<gchar> {
+    static gchar* ref (gchar* p) { return g_strdup(p); }
+    static void unref (gchar* p) { g_free(p); }
+    static gchar* adopt (gchar* p) { return p; }
+};
+
+template <>
+struct GHandleTraits<GMainLoop> {
+    static GMainLoop* ref (GMainLoop* p) { return g_main_loop_ref(p); }
+    static void unref (GMainLoop* p) { g_main_loop_unref(p); }
+    static GMainLoop* adopt (GMainLoop* p) { return p; }
+};
+
+// Plain g_malloc'ed memory, e.g. the container returned by g_variant_get_strv.
+template <typename T>
+struct GFreeTraits {
+    static void unref (T* p) { g_free(p); }
+    static T* adopt (T* p) { return p; }
+};
+
+// Owning handle. Moves only transfer the pointer; references are taken solely
+// on copy. Code that merely looks at an object borrows it through a GView.
+template <typename T, typename Traits = GHandleTraits<T>>
+struct GHandle {
+    constexpr GHandle () = default;
+
+    explicit GHandle (T* ptr) : ptr(ptr == nullptr ? nullptr : Traits::adopt(ptr)) {}
+
+    GHandle (const GHandle& other) : ptr(other.ptr == nullptr ? nullptr : Traits::ref(other.ptr)) {}
+
+    constexpr GHandle (GHandle&& other) noexcept : ptr(std::exchange(other.ptr, nullptr)) {}
+
+    GHandle& operator = (const GHandle& other) {
+        if (this != &other) reset(other.ptr == nullptr ? nullptr : Traits::ref(other.ptr));
+        return *this;
+    }
+
+    GHandle& operator = (GHandle&& other) noexcept {
+        if (this != &other) reset(std::exchange(other.ptr, nullptr));
+        return *this;
+    }
+
+    ~GHandle () {
+        if (ptr != nullptr) Traits::unref(ptr);
+    }
+
+    constexpr T* get () const { return ptr; }
+    constexpr T* operator -> () const { return ptr; }
+    constexpr explicit operator bool () const { return ptr != nullptr; }
+
+    // Takes an already adopted pointer.
+    void reset (T* other = nullptr) {
+        if (ptr != nullptr) Traits::unref(ptr);
+        ptr = other;
+    }
+
+    [[nodiscard]] T* release () { return std::exchange(ptr, nullptr); }
+
+    // For C out-parameters such as GError**.
+    T** out () {
+        reset();
+        return &ptr;
+    }
+
+private:
+    T* ptr = nullptr;
+};
+
+// Borrowed reference. Never touches the reference count.
+template <typename T>
+struct GView {
+    constexpr GView (T* ptr = nullptr) : ptr(ptr) {}
+
+    template <typename Traits>
+    constexpr GView (const GHandle<T, Traits>& handle) : ptr(handle.get()) {}
+
+    constexpr T* get () const { return ptr; }
+    constexpr T* operator -> () const { return ptr; }
+    constexpr explicit operator bool () const { return ptr != nullptr; }
+
+private:
+    T* ptr;
+};
+
+// Failure carried back to the caller. Nothing on the paths reachable from GLib
+// callbacks throws, since an exception unwinding through C frames terminates.
+struct Error {
+    std::string message;
+    GQuark domain = 0;
+    gint code = 0;
+
+    bool cancelled () const {
+        return domain == G_IO_ERROR && code == G_IO_ERROR_CANCELLED;
+    }
+};
+
+template <typename T>
+using Result = std::expected<T, Error>;
+
+static Result<void> check_error_code (const std::error_code& ec) {
+    if (ec) return std::unexpected(Error{ec.message()});
+    return {};
+}
+
+// Calls a GError reporting function, turning the GError into the Result.
+template <typename F, typename... ArgsT>
+inline auto handle_gfunc (F func, ArgsT... args) -> Result<decltype(func(args..., nullptr))> {
+    GHandle<GError> err;
+    auto result = func(args..., err.out());
+    if (err) {
+        return std::unexpected(Error{err->message, err->domain, err->code});
     }
     return result;
 }
 
+// Counts failures of one source and logs at most one line per interval,
+// so a persistently broken player cannot flood stderr.
+struct ErrorLog {
+    static constexpr gint64 interval_us = 60 * G_USEC_PER_SEC;
+
+    size_t count = 0;
+    size_t logged_count = 0;
+    gint64 last_logged_us = 0;
+
+    void report (std::string_view context, const Error& error) {
+        count++;
+        gint64 now = g_get_monotonic_time();
+        if (logged_count != 0 && now - last_logged_us < interval_us) return;
+        std::cerr << context << ": " << error.message;
+        if (count - logged_count > 1) {
+            std::cerr << " (" << count - logged_count << " failures since last report)";
+        }
+        std::cerr << "\n";
+        logged_count = count;
+        last_logged_us = now;
+    }
+};
+
 template <typename T>
 inline T g_object_get (auto *o, const char* k) {
     T value;
     g_object_get(G_OBJECT(o), k, &value, NULL);
     return value;
 }
-static std::string metadata_get_track_id(GVariant *metadata) {
-    GVariant *track_id_variant = g_variant_lookup_value(metadata, "mpris:trackid", G_VARIANT_TYPE_OBJECT_PATH);
-    if (track_id_variant == nullptr) {
+
+// Number of leading ASCII bytes in [p, p + n).
+static size_t ascii_prefix_length (const unsigned char* p, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(chunk));
+        if (mask != 0) return i + std::countr_zero(mask);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        if ((word & 0x8080808080808080ull) != 0) break;
+    }
+    while (i < n && p[i] < 0x80) i++;
+    return i;
+}
+
+struct Utf8Sequence {
+    size_t length;
+    bool valid;
+};
+
+// Inspects the (non ASCII) sequence at `p`. Invalid sequences report the length
+// of their maximal valid prefix, so each one collapses into a single U+FFFD.
+static Utf8Sequence utf8_inspect_sequence (const unsigned char* p, const unsigned char* end) {
+    unsigned char lead = p[0];
+    size_t length;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0) lo = 0xA0;       // overlong
+        else if (lead == 0xED) hi = 0x9F;  // surrogates
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0) lo = 0x90;       // overlong
+        else if (lead == 0xF4) hi = 0x8F;  // above U+10FFFF
+    } else {
+        return {1, false};
+    }
+
+    size_t available = static_cast<size_t>(end - p);
+    for (size_t i = 1; i < length; i++) {
+        if (i >= available || p[i] < lo || p[i] > hi) return {i, false};
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return {length, true};
+}
+
+// Validates `str` and replaces every ill-formed sequence with U+FFFD.
+// Valid input (the common case) is only scanned, never copied.
+static void sanitize_utf8 (std::string& str) {
+    constexpr std::string_view replacement = "\xEF\xBF\xBD";
+    auto begin = reinterpret_cast<const unsigned char*>(str.data());
+    auto end = begin + str.size();
+
+    const unsigned char* p = begin;
+    while (true) {
+        p += ascii_prefix_length(p, end - p);
+        if (p == end) return;
+        Utf8Sequence seq = utf8_inspect_sequence(p, end);
+        if (!seq.valid) break;
+        p += seq.length;
+    }
+
+    std::string repaired;
+    repaired.reserve(str.size() + replacement.size());
+    repaired.append(str.data(), p - begin);
+    while (p != end) {
+        size_t ascii = ascii_prefix_length(p, end - p);
+        repaired.append(reinterpret_cast<const char*>(p), ascii);
+        p += ascii;
+        if (p == end) break;
+        Utf8Sequence seq = utf8_inspect_sequence(p, end);
+        if (seq.valid) {
+            repaired.append(reinterpret_cast<const char*>(p), seq.length);
+        } else {
+            repaired.append(replacement);
+        }
+        p += seq.length;
+    }
+    str = std::move(repaired);
+}
+
+static std::string sanitized_utf8 (std::string&& str) {
+    sanitize_utf8(str);
+    return std::move(str);
+}
+
+// Codepoint count of already validated UTF-8.
+static size_t utf8_length (std::string_view str) {
+    auto p = reinterpret_cast<const unsigned char*>(str.data());
+    size_t n = str.size();
+    size_t continuation_bytes = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Continuation bytes (0x80..0xBF) are exactly the signed bytes below -64.
+    const __m128i threshold = _mm_set1_epi8(-64);
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmplt_epi8(chunk, threshold)));
+        continuation_bytes += std::popcount(mask);
+    }
+#endif
+    for (; i < n; i++) {
+        continuation_bytes += (p[i] & 0xC0) == 0x80;
+    }
+    return n - continuation_bytes;
+}
+
+// Advances `count` codepoints through already validated UTF-8.
+static const char* utf8_advance (const char* p, size_t count) {
+    static constexpr uint8_t lead_length[16] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
+    while (count-- > 0) {
+        p += lead_length[static_cast<unsigned char>(*p) >> 4];
+    }
+    return p;
+}
+
+// Decodes the codepoint at `p` of already validated UTF-8 and advances past it.
+static char32_t utf8_decode (const char*& p) {
+    auto c = static_cast<unsigned char>(*p++);
+    if (c < 0x80) return c;
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+    char32_t cp = c & (0x3F >> extra);
+    while (extra-- > 0) {
+        cp = (cp << 6) | (static_cast<unsigned char>(*p++) & 0x3F);
+    }
+    return cp;
+}
+
+static std::string metadata_get_track_id (GView<GVariant> metadata) {
+    GHandle<GVariant> track_id_variant{g_variant_lookup_value(metadata.get(), "mpris:trackid", G_VARIANT_TYPE_OBJECT_PATH)};
+    if (!track_id_variant) {
         g_debug("mpris:trackid is a string, not a D-Bus object reference");
-        track_id_variant = g_variant_lookup_value(metadata, "mpris:trackid", G_VARIANT_TYPE_STRING);
+        track_id_variant.reset(g_variant_lookup_value(metadata.get(), "mpris:trackid", G_VARIANT_TYPE_STRING));
     }
 
-    if (track_id_variant != nullptr) {
-        const gchar *track_id = g_variant_get_string(track_id_variant, NULL);
-        g_variant_unref(track_id_variant);
-        return {track_id};
+    if (track_id_variant) {
+        return {g_variant_get_string(track_id_variant.get(), NULL)};
     }
 
     return {};
 }
 
-static u_int64_t metadata_get_u64_value (GVariant *metadata, const char* key) {
-    GVariant *variant = g_variant_lookup_value(metadata, key, G_VARIANT_TYPE_UINT64);
-    if (variant == nullptr) return {};
-    return g_variant_get_uint64(variant);
+static u_int64_t metadata_get_u64_value (GView<GVariant> metadata, const char* key) {
+    GHandle<GVariant> variant{g_variant_lookup_value(metadata.get(), key, G_VARIANT_TYPE_UINT64)};
+    if (!variant) return {};
+    return g_variant_get_uint64(variant.get());
 }
 
 
-static std::string metadata_get_str_value (GVariant *metadata, const char* key) {
-    GVariant *variant = g_variant_lookup_value(metadata, key, G_VARIANT_TYPE_STRING);
-    if (variant == nullptr) return {};
-    const gchar *str = g_variant_get_string(variant, NULL);
-    g_variant_unref(variant);
-    return {str}; 
+static std::string metadata_get_str_value (GView<GVariant> metadata, const char* key) {
+    GHandle<GVariant> variant{g_variant_lookup_value(metadata.get(), key, G_VARIANT_TYPE_STRING)};
+    if (!variant) return {};
+    return {g_variant_get_string(variant.get(), NULL)};
 }
 
-static std::string metadata_get_str_array_value (GVariant *metadata, const char* key) {
-    GVariant *variant = g_variant_lookup_value(metadata, key, G_VARIANT_TYPE_STRING_ARRAY);
+static std::string metadata_get_str_array_value (GView<GVariant> metadata, const char* key) {
+    GHandle<GVariant> variant{g_variant_lookup_value(metadata.get(), key, G_VARIANT_TYPE_STRING_ARRAY)};
     std::string result;
+    if (!variant) return result;
     gsize prop_count = 0;
-    const gchar **prop_strv = g_variant_get_strv(variant, &prop_count);
+    GHandle<const gchar*, GFreeTraits<const gchar*>> prop_strv{g_variant_get_strv(variant.get(), &prop_count)};
 
     for (gsize i = 0; i < prop_count; i++) {
-        result += prop_strv[i];
+        result += prop_strv.get()[i];
         if (i != prop_count - 1) {
             result += ", ";
         }
     }
 
-    g_free(prop_strv);
-    return std::move(result);
+    return result;
 }
 
 
 
+// Track id of players that have no tracks, or no meaningful ids for them.
+static constexpr std::string_view no_track_id = "/org/mpris/MediaPlayer2/TrackList/NoTrack";
+
 struct MetadataChanges {
     bool length = false;
     bool trackid = false;
@@ -126,15 +456,16 @@ struct Metadata {
     }
 };
 
-static Metadata parse_metadata (GVariant* variant) {
+// All strings are sanitized here once, so everything downstream may assume valid UTF-8.
+static Metadata parse_metadata (GView<GVariant> variant) {
     return {
         metadata_get_u64_value(variant, "mpris:length"),
-        metadata_get_track_id(variant),
-        metadata_get_str_value(variant, "xesam:title"),
-        metadata_get_str_value(variant, "xesam:album"),
-        metadata_get_str_array_value(variant, "xesam:artist"),
-        metadata_get_str_value(variant, "mpris:artUrl"),
-        metadata_get_str_value(variant, "xesam:url")
+        sanitized_utf8(metadata_get_track_id(variant)),
+        sanitized_utf8(metadata_get_str_value(variant, "xesam:title")),
+        sanitized_utf8(metadata_get_str_value(variant, "xesam:album")),
+        sanitized_utf8(metadata_get_str_array_value(variant, "xesam:artist")),
+        sanitized_utf8(metadata_get_str_value(variant, "mpris:artUrl")),
+        sanitized_utf8(metadata_get_str_value(variant, "xesam:url"))
     };
 }
 
@@ -206,53 +537,267 @@ struct PlayerUID {
     };
 };
 
-template <typename T>
-struct GObjectWrapper {
-    constexpr GObjectWrapper(T* object) : object(object) {};
+struct UniqueOnly {
+    constexpr UniqueOnly () = default;
+    UniqueOnly(UniqueOnly&& other) = delete;
+    UniqueOnly(const UniqueOnly& other) = delete;
 
-    constexpr GObjectWrapper(const GObjectWrapper& other)
-    : object(other.object)
-    {
-        g_object_ref(object);
-    };
+    UniqueOnly& operator = (UniqueOnly&& other) = delete;
+    UniqueOnly& operator = (const UniqueOnly& other) = delete;
+};
 
-    constexpr GObjectWrapper(GObjectWrapper&& other)
-    : object(other.object)
-    {
-        other.object = nullptr;
-    };
+// Token bucket: `rate` tokens per second, holding at most `burst`.
+struct TokenBucket {
+    double rate;
+    double burst;
+    double tokens = burst;
+    gint64 last_refill_us = 0;
 
-    constexpr GObjectWrapper& operator = (const GObjectWrapper& other) {
-        object = other.object;
-        g_object_ref(object);
-        return *this;
-    };
+    bool try_acquire (gint64 now_us) {
+        refill(now_us);
+        if (tokens < 1) return false;
+        tokens -= 1;
+        return true;
+    }
 
-    constexpr GObjectWrapper& operator = (GObjectWrapper&& other) {
-        object = other.object;
-        other.object = nullptr;
-        return *this;
-    };
+    // Time until the next token is available.
+    gint64 wait_us (gint64 now_us) {
+        refill(now_us);
+        if (tokens >= 1) return 0;
+        return static_cast<gint64>((1 - tokens) / rate * G_USEC_PER_SEC) + 1;
+    }
 
-    constexpr ~GObjectWrapper () {
-        if (object != nullptr) {
-            g_object_unref(object);
-            object = nullptr;
+private:
+    void refill (gint64 now_us) {
+        if (last_refill_us != 0) {
+            tokens = std::min(burst, tokens + (now_us - last_refill_us) * rate / G_USEC_PER_SEC);
         }
+        last_refill_us = now_us;
+    }
+};
+
+// Exponentially decaying event rate in events per second.
+struct EventRate {
+    static constexpr double time_constant_s = 5;
+
+    double value = 0;
+    gint64 last_us = 0;
+
+    void record (gint64 now_us) {
+        value = at(now_us) + 1 / time_constant_s;
+        last_us = now_us;
     }
 
-    T* object;
+    double at (gint64 now_us) const {
+        if (last_us == 0) return 0;
+        return value * std::exp(-static_cast<double>(now_us - last_us) / G_USEC_PER_SEC / time_constant_s);
+    }
 };
 
-struct UniqueOnly {
-    constexpr UniqueOnly () = default;
-    UniqueOnly(UniqueOnly&& other) = delete;
-    UniqueOnly(const UniqueOnly& other) = delete;
+// Single source of all timed work. Timers sit in a hierarchical wheel of
+// `tick_us` resolution driven by one timerfd. Ticks count from CLOCK_MONOTONIC's
+// origin, which every process on the machine shares. Each timer has a tolerance, and
+// the timerfd is armed for the earliest instant some timer would exceed its
+// tolerance, so every timer due by then shares that one wakeup.
+class TimerWheel : UniqueOnly {
+public:
+    using Id = uint64_t;
 
-    UniqueOnly& operator = (UniqueOnly&& other) = delete;
-    UniqueOnly& operator = (const UniqueOnly& other) = delete;
+    static constexpr gint64 tick_us = 10 * 1000;
+    static constexpr size_t slot_bits = 6;
+    static constexpr size_t slots = size_t{1} << slot_bits;
+    static constexpr size_t levels = 3;
+
+    TimerWheel ()
+    :
+    fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    {}
+
+    ~TimerWheel () {
+        if (fd >= 0) close(fd);
+    }
+
+    // Timers may be scheduled before this, they start firing once the main loop runs.
+    void attach () {
+        if (fd < 0) {
+            std::cerr << "timerfd_create failed: " << std::strerror(errno) << "\n";
+            return;
+        }
+        attached_us = g_get_monotonic_time();
+        g_unix_fd_add(fd, G_IO_IN, on_readable, this);
+    }
+
+    Id schedule (guint delay_ms, guint tolerance_ms, std::function<void()> callback) {
+        return add(delay_ms, 0, tolerance_ms, std::move(callback));
+    }
+
+    // Aligned timers fire on multiples of their interval since the clock's origin,
+    // so they fire in phase with those of other processes.
+    Id schedule_periodic (guint interval_ms, guint tolerance_ms, std::function<void()> callback, bool aligned = false) {
+        if (!aligned) return add(interval_ms, interval_ms, tolerance_ms, std::move(callback));
+        uint64_t interval_ticks = ms_to_ticks(interval_ms);
+        uint64_t now = now_tick();
+        uint64_t delay_ticks = interval_ticks - now % interval_ticks;
+        return add(static_cast<guint>(delay_ticks * tick_us / 1000), interval_ms, tolerance_ms, std::move(callback));
+    }
+
+    // Safe to call from inside any timer callback, including the timer's own.
+    void cancel (Id id) {
+        if (id == 0) return;
+        if (id == running) {
+            running_cancelled = true;
+            return;
+        }
+        if (timers.erase(id) != 0) rearm();
+    }
+
+    uint64_t wakeups = 0;
+
+    double wakeups_per_minute () const {
+        if (attached_us == 0) return 0;
+        double minutes = static_cast<double>(g_get_monotonic_time() - attached_us) / (60.0 * G_USEC_PER_SEC);
+        return minutes > 0 ? wakeups / minutes : 0;
+    }
+
+    size_t size () const { return timers.size(); }
+
+private:
+    struct Timer {
+        uint64_t expiry_tick;
+        uint64_t interval_ticks;
+        uint64_t tolerance_ticks;
+        std::function<void()> callback;
+    };
+
+    std::unordered_map<Id, Timer> timers;
+    // Slots hold ids only; cancelled ids are dropped lazily when their slot comes up.
+    std::array<std::array<std::vector<Id>, slots>, levels> wheel;
+    uint64_t current_tick = 0;
+    uint64_t armed_tick = 0;
+    Id next_id = 1;
+    Id running = 0;
+    bool running_cancelled = false;
+    int fd;
+    gint64 attached_us = 0;
+
+    uint64_t now_tick () const {
+        return static_cast<uint64_t>(g_get_monotonic_time()) / tick_us;
+    }
+
+    static uint64_t ms_to_ticks (guint ms) {
+        return (static_cast<uint64_t>(ms) * 1000 + tick_us - 1) / tick_us;
+    }
+
+    Id add (guint delay_ms, guint interval_ms, guint tolerance_ms, std::function<void()> callback) {
+        uint64_t now = now_tick();
+        // Nothing pending, so there is nothing to cascade on the way to now.
+        if (timers.empty() && now > current_tick) current_tick = now;
+        Id id = next_id++;
+        uint64_t expiry = std::max(now, current_tick) + std::max<uint64_t>(ms_to_ticks(delay_ms), 1);
+        timers.emplace(id, Timer{expiry, ms_to_ticks(interval_ms), ms_to_ticks(tolerance_ms), std::move(callback)});
+        insert(id, expiry);
+        rearm();
+        return id;
+    }
+
+    void insert (Id id, uint64_t expiry) {
+        uint64_t delta = expiry - current_tick;
+        size_t level = 0;
+        while (level + 1 < levels && delta >= (uint64_t{1} << (slot_bits * (level + 1)))) {
+            level++;
+        }
+        // Beyond the wheel's range: park in the farthest slot and re-insert from there.
+        uint64_t max_delta = (uint64_t{1} << (slot_bits * levels)) - 1;
+        uint64_t placed = delta > max_delta ? current_tick + max_delta : expiry;
+        wheel[level][(placed >> (slot_bits * level)) & (slots - 1)].push_back(id);
+    }
+
+    void advance (uint64_t target) {
+        while (current_tick < target) {
+            if (timers.empty()) {
+                current_tick = target;
+                break;
+            }
+            current_tick++;
+            for (size_t level = levels - 1; level > 0; level--) {
+                uint64_t mask = (uint64_t{1} << (slot_bits * level)) - 1;
+                if ((current_tick & mask) != 0) continue;
+                auto cascading = std::move(wheel[level][(current_tick >> (slot_bits * level)) & (slots - 1)]);
+                wheel[level][(current_tick >> (slot_bits * level)) & (slots - 1)].clear();
+                for (Id id : cascading) {
+                    auto entry = timers.find(id);
+                    if (entry != timers.end()) insert(id, entry->second.expiry_tick);
+                }
+            }
+            auto due = std::move(wheel[0][current_tick & (slots - 1)]);
+            wheel[0][current_tick & (slots - 1)].clear();
+            for (Id id : due) fire(id);
+        }
+    }
+
+    void fire (Id id) {
+        auto entry = timers.find(id);
+        if (entry == timers.end()) return;
+        if (entry->second.expiry_tick > current_tick) {
+            insert(id, entry->second.expiry_tick);
+            return;
+        }
+
+        running = id;
+        running_cancelled = false;
+        entry->second.callback();
+        running = 0;
+
+        // The callback may have added timers, so look the entry up again.
+        entry = timers.find(id);
+        if (entry == timers.end()) return;
+        Timer& timer = entry->second;
+        if (timer.interval_ticks == 0 || running_cancelled) {
+            timers.erase(entry);
+            return;
+        }
+        // Keep the period's phase; a late wakeup skips the missed periods.
+        timer.expiry_tick += timer.interval_ticks;
+        if (timer.expiry_tick <= current_tick) {
+            uint64_t behind = current_tick - timer.expiry_tick;
+            timer.expiry_tick += (behind / timer.interval_ticks + 1) * timer.interval_ticks;
+        }
+        insert(id, timer.expiry_tick);
+    }
+
+    // There are only ever a handful of timers, a linear scan is cheaper than
+    // keeping the wheel searchable.
+    void rearm () {
+        if (fd < 0) return;
+        uint64_t target = std::numeric_limits<uint64_t>::max();
+        for (const auto& [id, timer] : timers) {
+            target = std::min(target, timer.expiry_tick + timer.tolerance_ticks);
+        }
+        if (target == armed_tick) return;
+        armed_tick = target;
+
+        itimerspec spec{};
+        if (target != std::numeric_limits<uint64_t>::max()) {
+            gint64 deadline_us = static_cast<gint64>(target) * tick_us;
+            spec.it_value.tv_sec = deadline_us / G_USEC_PER_SEC;
+            spec.it_value.tv_nsec = (deadline_us % G_USEC_PER_SEC) * 1000;
+        }
+        timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    static gboolean on_readable (gint fd, GIOCondition condition, gpointer data) {
+        auto self = static_cast<TimerWheel*>(data);
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) > 0) self->wakeups++;
+        self->armed_tick = 0;
+        self->advance(self->now_tick());
+        self->rearm();
+        return G_SOURCE_CONTINUE;
+    }
 };
 
+static TimerWheel timer_wheel;
+
 #define simple_player_prop_handler(TYPE, NAME)                              \
 G_CALLBACK(+[](PlayerctlPlayerManager *manager, TYPE value, Player* self) { \
     self->state.NAME = value;                                               \
@@ -264,7 +809,7 @@ struct PlayerManager;
 
 
 
-struct Player : GObjectWrapper<PlayerctlPlayer>, UniqueOnly {
+struct Player : GHandle<PlayerctlPlayer>, UniqueOnly {
 
     struct State {
         Metadata metadata;
@@ -276,6 +821,7 @@ struct Player : GObjectWrapper<PlayerctlPlayer>, UniqueOnly {
         struct Handler {
             virtual void on_state(const Player&) {};
             virtual void on_select(const Player&) {};
+            virtual void on_seeked(const Player&) {};
         };
     };
 
@@ -284,20 +830,42 @@ struct Player : GObjectWrapper<PlayerctlPlayer>, UniqueOnly {
     State::Handler* state_handler;
     bool is_selected = false;
 
-    constexpr Player (PlayerctlPlayerName* name, PlayerUID&& uid, State::Handler* state_handler)
-    :
-    Player{
-        handle_gfunc<PlayerctlPlayer*>(playerctl_player_new_from_name, name),
-        name,
-        std::move(uid),
-        state_handler
+    // Some players repeat PropertiesChanged many times a second for unchanged data.
+    // State callbacks are limited per player; a player that keeps exceeding the limit
+    // is quarantined and only sampled periodically until it calms down.
+    static constexpr double state_rate_limit = 10;
+    static constexpr double state_burst = 20;
+    static constexpr double quarantine_enter_rate = 20;
+    static constexpr double quarantine_leave_rate = 4;
+    static constexpr guint quarantine_sample_ms = 1000;
+    static constexpr guint state_flush_tolerance_ms = 50;
+
+    struct EventStats {
+        uint64_t received = 0;
+        uint64_t delivered = 0;
+        uint64_t deferred = 0;
+        uint64_t quarantines = 0;
+        EventRate rate;
+    };
+    EventStats state_events;
+    TokenBucket state_bucket{state_rate_limit, state_burst};
+    bool quarantined = false;
+    bool state_pending = false;
+    TimerWheel::Id state_flush_timer = 0;
+
+    static Result<Player*> create (PlayerctlPlayerName* name, PlayerUID&& uid, State::Handler* state_handler) {
+        auto player = handle_gfunc(playerctl_player_new_from_name, name);
+        if (!player) return std::unexpected(std::move(player.error()));
+        if (*player == nullptr) {
+            return std::unexpected(Error{"[playerctl_player_new_from_name] returned nullptr"});
+        }
+        return new Player{*player, name, std::move(uid), state_handler};
     }
-    {}
 
 private:
     static State create_state (PlayerctlPlayer* player) {
         return {
-            parse_metadata(g_object_get<GVariant*>(player, "metadata")),
+            parse_metadata(GHandle<GVariant>{g_object_get<GVariant*>(player, "metadata")}),
             g_object_get<PlayerctlLoopStatus>(player, "loop-status"),
             g_object_get<PlayerctlPlaybackStatus>(player, "playback-status"),
             g_object_get<gdouble>(player, "volume"),
@@ -306,15 +874,15 @@ private:
         };
     }
 
-    constexpr Player(PlayerctlPlayer* player, PlayerctlPlayerName* name, PlayerUID&& uid, State::Handler* state_handler)
+    Player(PlayerctlPlayer* player, PlayerctlPlayerName* name, PlayerUID&& uid, State::Handler* state_handler)
     :
+    GHandle{player},
     uid(std::move(uid)),
     state(create_state(player)),
-    state_handler(state_handler),
-    GObjectWrapper{player}
+    state_handler(state_handler)
     {
         g_signal_connect(
-            G_OBJECT(object),
+            G_OBJECT(get()),
             "metadata",
             G_CALLBACK(+[](PlayerctlPlayerManager *manager, GVariant* variant, Player* self) {
                 self->state.metadata = parse_metadata(variant);
@@ -323,31 +891,31 @@ private:
             this
         );
         g_signal_connect(
-            object,
+            get(),
             "playback-status",
             simple_player_prop_handler(PlayerctlPlaybackStatus, playback_status),
             this
         );
         g_signal_connect(
-            object,
+            get(),
             "loop-status",
             simple_player_prop_handler(PlayerctlLoopStatus, loop_status),
             this
         );
         g_signal_connect(
-            object,
+            get(),
             "volume",
             simple_player_prop_handler(gdouble, volume),
             this
         );
         g_signal_connect(
-            object,
+            get(),
             "shuffle",
             simple_player_prop_handler(bool, shuffle),
             this
         );
 
-        g_signal_connect(object->priv->proxy,
+        g_signal_connect(get()->priv->proxy,
             "g-properties-changed",
             G_CALLBACK(+[](
                 void* proxy,
@@ -355,11 +923,11 @@ private:
                 char** invalidated_properties,
                 Player* self
             ) {
-                self->state_handler->on_state(*self);
+                self->on_properties_changed();
             }),
             this
         );
-        g_signal_connect(object->priv->proxy,
+        g_signal_connect(get()->priv->proxy,
             "g-signal::Seeked",
             G_CALLBACK(+[](
                 void* proxy,
@@ -373,18 +941,76 @@ private:
                     // std::cout << "Invalid seeked parameters";
                     return;
                 };
-                GVariant *child = g_variant_get_child_value(parameters, 0);
-                if (child == nullptr) {
+                GHandle<GVariant> child{g_variant_get_child_value(parameters, 0)};
+                if (!child) {
                     // std::cout << "Invalid seeked parameters";
                     return;
                 };
-                gint64 value = g_variant_get_int64(child);
+                gint64 value = g_variant_get_int64(child.get());
                 // std::cout << "Seeked to: " << value << "\n";
+                self->state.seeked_to = static_cast<uint64_t>(std::max<gint64>(value, 0));
+                self->state_handler->on_seeked(*self);
             }),
             this
         );
     }
+
+    void on_properties_changed () {
+        gint64 now = g_get_monotonic_time();
+        state_events.received++;
+        state_events.rate.record(now);
+        if (!quarantined && state_bucket.try_acquire(now)) {
+            deliver_state();
+            return;
+        }
+
+        state_pending = true;
+        state_events.deferred++;
+        if (!quarantined && state_events.rate.at(now) > quarantine_enter_rate) {
+            quarantined = true;
+            state_events.quarantines++;
+            std::cerr << "Quarantining player " << uid.name << " ("
+            << state_events.rate.at(now) << " state events/s)\n";
+            timer_wheel.cancel(state_flush_timer);
+            state_flush_timer = timer_wheel.schedule_periodic(quarantine_sample_ms, quarantine_sample_ms / 4, [this] {
+                flush_state();
+            });
+        } else if (state_flush_timer == 0) {
+            guint wait_ms = static_cast<guint>(state_bucket.wait_us(now) / 1000) + 1;
+            state_flush_timer = timer_wheel.schedule(wait_ms, state_flush_tolerance_ms, [this] {
+                state_flush_timer = 0;
+                flush_state();
+            });
+        }
+    }
+
+    void deliver_state () {
+        state_pending = false;
+        state_events.delivered++;
+        state_handler->on_state(*this);
+    }
+
+    void flush_state () {
+        gint64 now = g_get_monotonic_time();
+        if (state_pending) {
+            if (!quarantined) state_bucket.try_acquire(now);
+            deliver_state();
+        }
+        if (quarantined && state_events.rate.at(now) < quarantine_leave_rate) {
+            quarantined = false;
+            timer_wheel.cancel(state_flush_timer);
+            state_flush_timer = 0;
+        }
+    }
+
 public:
+    ~Player () {
+        timer_wheel.cancel(state_flush_timer);
+        if (empty()) return;
+        g_signal_handlers_disconnect_by_data(get()->priv->proxy, this);
+        g_signal_handlers_disconnect_by_data(get(), this);
+    }
+
     void on_playback_status (PlayerctlPlaybackStatus status) {}
     void on_loop_status (PlayerctlLoopStatus status) {}
     void on_volume (double volume) {}
@@ -395,35 +1021,50 @@ public:
         state_handler->on_select(*this);
     }
 
-    constexpr bool empty () const { return object == nullptr; }
+    constexpr bool empty () const { return get() == nullptr; }
 };
 
 struct ManagedPlayerHandler : Player::State::Handler {
     virtual void on_empty () = 0;
+    // Player to select over the first discovered one, if it is present at startup.
+    virtual const PlayerUID* preferred_player () const { return nullptr; }
 };
 
-struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
-    constexpr PlayerManager(ManagedPlayerHandler* handler)
+struct PlayerManager : GHandle<PlayerctlPlayerManager>, UniqueOnly {
+    // Check empty() afterwards, a manager that failed to initialize stays empty.
+    PlayerManager(ManagedPlayerHandler* handler)
     :
-    GObjectWrapper{handle_gfunc(playerctl_player_manager_new)},
     handler(handler)
     {
-        if (!object) {
-            throw std::runtime_error{"[playerctl_player_manager_new] returned nullptr"};
+        auto manager = handle_gfunc(playerctl_player_manager_new);
+        if (!manager || *manager == nullptr) {
+            std::cerr << "Failed to create player manager: "
+            << (manager ? "[playerctl_player_manager_new] returned nullptr" : manager.error().message) << "\n";
+            return;
         }
+        static_cast<GHandle&>(*this) = GHandle{*manager};
 
-        GList *player_names = nullptr;
-        g_object_get(object, "player-names", &player_names, NULL);
-        for (GList* l = player_names; l != nullptr; l = l->next) {
+        // Owned by the manager, only borrowed here.
+        GView<GList> player_names = g_object_get<GList*>(get(), "player-names");
+        for (GList* l = player_names.get(); l != nullptr; l = l->next) {
             PlayerctlPlayerName *name = static_cast<PlayerctlPlayerName*>(l->data);
             assert(name != nullptr);
             // std::cout << "Found player: " << name->instance << "\n";
 
-            add_player_by_name(name);
+            add_player_by_name(name, false);
+        }
+
+        if (!managed_players.empty()) {
+            const PlayerUID* preferred = handler->preferred_player();
+            auto entry = std::ranges::find_if(managed_players, [preferred](const Player* p) {
+                return preferred != nullptr && p->uid == *preferred;
+            });
+            selected_idx = entry == managed_players.end() ? 0 : entry - managed_players.begin();
+            managed_players[selected_idx]->select();
         }
         
         g_signal_connect(
-            PLAYERCTL_PLAYER_MANAGER(object),
+            PLAYERCTL_PLAYER_MANAGER(get()),
             "name-appeared",
             G_CALLBACK(+[](PlayerctlPlayerManager *manager, PlayerctlPlayerName *name, PlayerManager* self) {
                 self->on_name_appeared(manager, name);
@@ -432,7 +1073,7 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
         );
 
          g_signal_connect(
-            PLAYERCTL_PLAYER_MANAGER(object),
+            PLAYERCTL_PLAYER_MANAGER(get()),
             "name-vanished",
             G_CALLBACK(+[](PlayerctlPlayerManager *manager, PlayerctlPlayerName *name, PlayerManager* self) {
                 self->on_name_vanished(manager, name);
@@ -441,14 +1082,14 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
         );
 
         g_signal_connect(
-            PLAYERCTL_PLAYER_MANAGER(object),
+            PLAYERCTL_PLAYER_MANAGER(get()),
             "player-appeared",
             G_CALLBACK(on_player_appeared),
             this
         );
 
         g_signal_connect(
-            PLAYERCTL_PLAYER_MANAGER(object),
+            PLAYERCTL_PLAYER_MANAGER(get()),
             "player-vanished",
             G_CALLBACK(on_player_vanished),
             this
@@ -457,6 +1098,31 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
         // std::cout << "[PlayerManager] initialized\n";
     }
 
+    // Drops every player at once, without the per-player reselection and
+    // notifications on_name_vanished would trigger.
+    ~PlayerManager () {
+        if (!empty()) g_signal_handlers_disconnect_by_data(get(), this);
+        for (Player* player : managed_players) {
+            delete player;
+        }
+        managed_players.clear();
+        selected_idx = NON_IDX;
+    }
+
+    void report_event_rates (std::ostream& os) const {
+        gint64 now = g_get_monotonic_time();
+        for (const Player* player : managed_players) {
+            const auto& events = player->state_events;
+            os << player->uid.name << ": "
+            << events.rate.at(now) << " state events/s, "
+            << events.received << " received, "
+            << events.delivered << " delivered, "
+            << events.deferred << " deferred, "
+            << events.quarantines << " quarantines"
+            << (player->quarantined ? " [quarantined]" : "") << "\n";
+        }
+    }
+
     // Get current player list
     const Player* selected_player () const {
         if (selected_idx == NON_IDX) {
@@ -466,7 +1132,10 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
         }
     }
 
+    constexpr bool empty () const { return get() == nullptr; }
+
     std::vector<Player*> managed_players; // Add player source into hash to ensure no overlaps
+    std::unordered_map<PlayerUID, ErrorLog, PlayerUID::hash> player_errors;
     static size_t constexpr NON_IDX = -1;
     size_t selected_idx = NON_IDX;
     ManagedPlayerHandler* handler = nullptr;
@@ -474,7 +1143,7 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
     // void on_state (const Player& player) override {}
     // void on_select (const Player& player) override {}
 
-    void add_player_by_name (PlayerctlPlayerName *name) {
+    void add_player_by_name (PlayerctlPlayerName *name, bool auto_select = true) {
         PlayerUID player_uid {name->instance, name->source};
         bool exists = std::ranges::any_of(
             managed_players,
@@ -484,11 +1153,16 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
             display_print("Should not exist!");
             return;
         }
-        auto player = new Player{name, std::move(player_uid), handler};
+        auto created = Player::create(name, PlayerUID{player_uid}, handler);
+        if (!created) {
+            player_errors[player_uid].report("Failed to attach to player " + player_uid.name, created.error());
+            return;
+        }
+        auto player = *created;
         managed_players.push_back(player);
         // playerctl_player_manager_manage_player(manager, player);      
 
-        if (selected_idx == NON_IDX) {
+        if (auto_select && selected_idx == NON_IDX) {
             player->select();
             selected_idx = managed_players.size() - 1;
             // std::cout << "selected: " << managed_players[selected_idx].object->priv->instance << "\n";
@@ -507,7 +1181,8 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
             return p->uid == player_uid;
         });
         if (entry == managed_players.end()) {
-            display_print("Should exist!");
+            // Players that failed to attach were never managed.
+            if (!player_errors.contains(player_uid)) display_print("Should exist!");
             return;
         }
         bool was_selected = entry[0]->is_selected;
@@ -535,107 +1210,2702 @@ struct PlayerManager : GObjectWrapper<PlayerctlPlayerManager>, UniqueOnly {
     }
 };
 
-static GMainLoop* main_loop = nullptr;
+// Watches the user's graphical logind session and reports whether anybody can
+// see the bar, i.e. the session is neither idle nor locked. Setup is asynchronous
+// and failures leave the session treated as active.
+struct SessionActivityMonitor : UniqueOnly {
+    struct Handler {
+        virtual void on_session_active (bool active) {};
+    };
 
-static bool handled_exit = false;
-void exit_handler () {
-    if (handled_exit) return;
-    display_print("Exiting cleanly...");
-    if (main_loop != nullptr) {
-        g_main_loop_quit(main_loop);
+    SessionActivityMonitor (Handler* handler)
+    :
+    handler(handler),
+    cancellable(g_cancellable_new())
+    {
+        g_dbus_proxy_new_for_bus(
+            G_BUS_TYPE_SYSTEM,
+            G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+            nullptr,
+            "org.freedesktop.login1",
+            "/org/freedesktop/login1/user/self",
+            "org.freedesktop.login1.User",
+            cancellable.get(),
+            on_user_proxy,
+            this
+        );
     }
-    handled_exit = true;
-}
 
-class EscapedString {
-public:
-    explicit EscapedString(std::string_view str)
-        : data(std::move(str)) {}
+    ~SessionActivityMonitor () {
+        g_cancellable_cancel(cancellable.get());
+        if (session) g_signal_handlers_disconnect_by_data(session.get(), this);
+    }
 
-    const std::string_view& get() const { return data; }
+    bool active = true;
 
 private:
-    std::string_view data;
-
-    friend std::ostream& operator<<(std::ostream& os, const EscapedString& es) {
-        const std::string_view& s = es.data;
-        std::size_t last = 0;
-
-        for (std::size_t i = 0; i < s.size(); ++i) {
-            char c = s[i];
-            std::string escape;
-            switch (c) {
-                case '&':  escape = "&amp;";  break;
-                case '\"': escape = "&quot;"; break;
-                case '\'': escape = "&apos;"; break;
-                case '<':  escape = "&lt;";   break;
-                case '>':  escape = "&gt;";   break;
-                case '\n': escape = "\\n";    break;
-                case '\t': escape = "\\t";    break;
-                case '\r': escape = "\\r";    break;
-            }
+    Handler* handler;
+    GHandle<GCancellable> cancellable;
+    GHandle<GDBusProxy> session;
+    ErrorLog errors;
 
-            if (!escape.empty()) {
-                // dump everything since last safe char
-                if (i > last) {
-                    os.write(&s[last], i - last);
-                }
-                os << escape;
-                last = i + 1; // move past escaped char
-            }
+    // `data` is only touched once the call is known not to be cancelled,
+    // cancellation means the monitor is gone.
+    static void on_user_proxy (GObject*, GAsyncResult* result, gpointer data) {
+        auto user = handle_gfunc(g_dbus_proxy_new_for_bus_finish, result);
+        if (!user && user.error().cancelled()) return;
+        auto self = static_cast<SessionActivityMonitor*>(data);
+        if (!user) {
+            return self->errors.report("Failed to reach logind", user.error());
         }
+        GHandle<GDBusProxy> user_proxy{*user};
 
-        // flush any remaining chunk
-        if (last < s.size()) {
-            os.write(&s[last], s.size() - last);
+        GHandle<GVariant> display{g_dbus_proxy_get_cached_property(user_proxy.get(), "Display")};
+        const gchar* session_path = nullptr;
+        if (display && g_variant_is_of_type(display.get(), G_VARIANT_TYPE("(so)"))) {
+            g_variant_get(display.get(), "(&s&o)", nullptr, &session_path);
+        }
+        if (session_path == nullptr || std::string_view{session_path} == "/") {
+            return self->errors.report("Failed to watch session", Error{"user has no graphical session"});
         }
 
-        return os;
+        g_dbus_proxy_new_for_bus(
+            G_BUS_TYPE_SYSTEM,
+            G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+            nullptr,
+            "org.freedesktop.login1",
+            session_path,
+            "org.freedesktop.login1.Session",
+            self->cancellable.get(),
+            on_session_proxy,
+            self
+        );
     }
-};
 
-void encode_into (std::string& buffer, std::string_view str) {
-    buffer.reserve(buffer.size() + str.size());
-    for(auto c : str) {
-        switch(c) {
-            case '&':  buffer.append("&amp;");       break;
-            case '\"': buffer.append("&quot;");      break;
-            case '\'': buffer.append("&apos;");      break;
-            case '<':  buffer.append("&lt;");        break;
-            case '>':  buffer.append("&gt;");        break;
-            case '\n': buffer.append("\\n");         break;
-            case '\t': buffer.append("\\t");         break;
-            case '\r': buffer.append("\\r");         break;
-            default:   buffer.append(1, c);          break;
+    static void on_session_proxy (GObject*, GAsyncResult* result, gpointer data) {
+        auto session = handle_gfunc(g_dbus_proxy_new_for_bus_finish, result);
+        if (!session && session.error().cancelled()) return;
+        auto self = static_cast<SessionActivityMonitor*>(data);
+        if (!session) {
+            return self->errors.report("Failed to watch session", session.error());
         }
+        self->session = GHandle<GDBusProxy>{*session};
+        g_signal_connect(
+            self->session.get(),
+            "g-properties-changed",
+            G_CALLBACK(+[](GDBusProxy*, GVariant*, char**, SessionActivityMonitor* self) {
+                self->update();
+            }),
+            self
+        );
+        self->update();
     }
-}
 
+    bool get_bool_property (const char* name) const {
+        GHandle<GVariant> value{g_dbus_proxy_get_cached_property(session.get(), name)};
+        return value && g_variant_is_of_type(value.get(), G_VARIANT_TYPE_BOOLEAN) && g_variant_get_boolean(value.get());
+    }
 
-namespace fs = std::filesystem;
+    void update () {
+        bool new_active = !get_bool_property("IdleHint") && !get_bool_property("LockedHint");
+        if (new_active == active) return;
+        active = new_active;
+        handler->on_session_active(active);
+    }
+};
 
-static const fs::path cache_path = fs::path{std::getenv("HOME")}/".cache/mpris-cover.png";
+// Watches UPower's OnBattery. Failures leave the system treated as on AC.
+struct PowerSourceMonitor : UniqueOnly {
+    struct Handler {
+        virtual void on_battery_changed (bool on_battery) {};
+    };
 
-struct OutputGenerator : ManagedPlayerHandler {
-    constexpr OutputGenerator() : manager(this) {}
+    PowerSourceMonitor (Handler* handler)
+    :
+    handler(handler),
+    cancellable(g_cancellable_new())
+    {
+        g_dbus_proxy_new_for_bus(
+            G_BUS_TYPE_SYSTEM,
+            G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+            nullptr,
+            "org.freedesktop.UPower",
+            "/org/freedesktop/UPower",
+            "org.freedesktop.UPower",
+            cancellable.get(),
+            on_proxy,
+            this
+        );
+    }
 
-    std::string to_display;
-    size_t to_display_utf8_len = 0;
-    bool needs_scrolling = false;
-    size_t display_offset = 0;
+    ~PowerSourceMonitor () {
+        g_cancellable_cancel(cancellable.get());
+        if (upower) g_signal_handlers_disconnect_by_data(upower.get(), this);
+    }
 
-    bool is_playing = false;
+    bool on_battery = false;
 
-    struct LastSource {
-        std::string title;
-        std::string artist;
+private:
+    Handler* handler;
+    GHandle<GCancellable> cancellable;
+    GHandle<GDBusProxy> upower;
+    ErrorLog errors;
+
+    static void on_proxy (GObject*, GAsyncResult* result, gpointer data) {
+        auto upower = handle_gfunc(g_dbus_proxy_new_for_bus_finish, result);
+        if (!upower && upower.error().cancelled()) return;
+        auto self = static_cast<PowerSourceMonitor*>(data);
+        if (!upower) {
+            return self->errors.report("Failed to reach UPower", upower.error());
+        }
+        self->upower = GHandle<GDBusProxy>{*upower};
+        g_signal_connect(
+            self->upower.get(),
+            "g-properties-changed",
+            G_CALLBACK(+[](GDBusProxy*, GVariant*, char**, PowerSourceMonitor* self) {
+                self->update();
+            }),
+            self
+        );
+        self->update();
+    }
+
+    void update () {
+        GHandle<GVariant> value{g_dbus_proxy_get_cached_property(upower.get(), "OnBattery")};
+        bool new_on_battery = value && g_variant_is_of_type(value.get(), G_VARIANT_TYPE_BOOLEAN) && g_variant_get_boolean(value.get());
+        if (new_on_battery == on_battery) return;
+        on_battery = new_on_battery;
+        handler->on_battery_changed(on_battery);
+    }
+};
+
+// Fetches the metadata of the tracks queued after the current one from players
+// implementing org.mpris.MediaPlayer2.TrackList, so they can be rendered before
+// they play. Players that fail to report a track list are not asked again.
+struct TrackListPrefetcher : UniqueOnly {
+    struct Handler {
+        virtual void on_upcoming_tracks (const PlayerUID& player, std::vector<Metadata>&& tracks) {};
+    };
+
+    static constexpr size_t lookahead = 3;
+    static constexpr gint call_timeout_ms = 1000;
+
+    TrackListPrefetcher (Handler* handler) : handler(handler) {}
+
+    ~TrackListPrefetcher () {
+        if (cancellable) g_cancellable_cancel(cancellable.get());
+    }
+
+    // Supersedes a lookup still in flight.
+    void prefetch (const PlayerUID& player, const std::string& trackid) {
+        if (trackid.empty() || trackid == no_track_id || unsupported.contains(player)) return;
+        GBusType bus_type = player.source == PLAYERCTL_SOURCE_DBUS_SYSTEM ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION;
+        // The shared connection playerctl already opened, so this does not block.
+        auto bus = handle_gfunc(g_bus_get_sync, bus_type, static_cast<GCancellable*>(nullptr));
+        if (!bus) {
+            return errors.report("Failed to prefetch tracks", bus.error());
+        }
+        if (cancellable) g_cancellable_cancel(cancellable.get());
+        cancellable.reset(g_cancellable_new());
+
+        auto request = new Request{this, player, trackid, GHandle<GDBusConnection>{*bus}, cancellable};
+        g_dbus_connection_call(
+            request->bus.get(),
+            request->bus_name().c_str(),
+            object_path,
+            "org.freedesktop.DBus.Properties",
+            "Get",
+            g_variant_new("(ss)", interface, "Tracks"),
+            G_VARIANT_TYPE("(v)"),
+            G_DBUS_CALL_FLAGS_NONE,
+            call_timeout_ms,
+            cancellable.get(),
+            on_tracks,
+            request
+        );
+    }
+
+private:
+    static constexpr const char* object_path = "/org/mpris/MediaPlayer2";
+    static constexpr const char* interface = "org.mpris.MediaPlayer2.TrackList";
+
+    // One lookup, owned by whichever callback is pending. `self` is only touched
+    // once the call is known not to be cancelled.
+    struct Request {
+        TrackListPrefetcher* self;
+        PlayerUID player;
+        std::string trackid;
+        GHandle<GDBusConnection> bus;
+        GHandle<GCancellable> cancellable;
+
+        std::string bus_name () const {
+            return "org.mpris.MediaPlayer2." + player.name;
+        }
+    };
+
+    Handler* handler;
+    GHandle<GCancellable> cancellable;
+    std::unordered_set<PlayerUID, PlayerUID::hash> unsupported;
+    ErrorLog errors;
+
+    static void on_tracks (GObject*, GAsyncResult* result, gpointer data) {
+        std::unique_ptr<Request> request{static_cast<Request*>(data)};
+        auto reply = handle_gfunc(g_dbus_connection_call_finish, request->bus.get(), result);
+        if (!reply && reply.error().cancelled()) return;
+        auto self = request->self;
+        if (!reply) {
+            self->unsupported.insert(request->player);
+            return;
+        }
+        GHandle<GVariant> value{*reply};
+        GHandle<GVariant> tracks;
+        g_variant_get(value.get(), "(v)", tracks.out());
+        if (!g_variant_is_of_type(tracks.get(), G_VARIANT_TYPE("ao"))) {
+            self->unsupported.insert(request->player);
+            return;
+        }
+
+        // Ids of the tracks after the current one.
+        std::vector<GHandle<GVariant>> ids;
+        gsize count = g_variant_n_children(tracks.get());
+        gsize next = count;
+        for (gsize i = 0; i < count && ids.size() < lookahead; i++) {
+            GHandle<GVariant> id{g_variant_get_child_value(tracks.get(), i)};
+            if (i >= next) {
+                ids.push_back(std::move(id));
+            } else if (request->trackid == g_variant_get_string(id.get(), nullptr)) {
+                next = i + 1;
+            }
+        }
+        if (ids.empty()) return;
+        std::vector<GVariant*> children;
+        for (const auto& id : ids) children.push_back(id.get());
+
+        GCancellable* cancellable = request->cancellable.get();
+        GDBusConnection* bus = request->bus.get();
+        std::string bus_name = request->bus_name();
+        g_dbus_connection_call(
+            bus,
+            bus_name.c_str(),
+            object_path,
+            interface,
+            "GetTracksMetadata",
+            g_variant_new("(@ao)", g_variant_new_array(G_VARIANT_TYPE_OBJECT_PATH, children.data(), children.size())),
+            G_VARIANT_TYPE("(aa{sv})"),
+            G_DBUS_CALL_FLAGS_NONE,
+            call_timeout_ms,
+            cancellable,
+            on_metadata,
+            request.release()
+        );
+    }
+
+    static void on_metadata (GObject*, GAsyncResult* result, gpointer data) {
+        std::unique_ptr<Request> request{static_cast<Request*>(data)};
+        auto reply = handle_gfunc(g_dbus_connection_call_finish, request->bus.get(), result);
+        if (!reply && reply.error().cancelled()) return;
+        auto self = request->self;
+        if (!reply) {
+            return self->errors.report("Failed to prefetch tracks", reply.error());
+        }
+        GHandle<GVariant> value{*reply};
+        GHandle<GVariant> list{g_variant_get_child_value(value.get(), 0)};
+        std::vector<Metadata> tracks;
+        gsize count = g_variant_n_children(list.get());
+        for (gsize i = 0; i < count; i++) {
+            tracks.push_back(parse_metadata(GHandle<GVariant>{g_variant_get_child_value(list.get(), i)}));
+        }
+        self->handler->on_upcoming_tracks(request->player, std::move(tracks));
+    }
+};
+
+// How much work rendering may cost. One profile applies on AC, one on battery.
+struct RenderProfile {
+    guint scroll_interval_ms;
+    // Covers are decoded to make thumbnails and palettes; without, they are
+    // linked as they are and only palettes already computed are used.
+    bool decode_covers;
+};
+
+struct Config {
+    RenderProfile ac_profile{100, true};
+    RenderProfile battery_profile{500, false};
+    bool show_album = false;
+    bool prefetch = true;
+    // Metrics mode: widths in pixels of the given font instead of codepoints.
+    std::string font_path;
+    guint font_size_px = 0;
+    guint pixel_width = 0;
+    // Cover paths go into the output stream instead of signalling the bar.
+    bool cover_in_output = false;
+    // Text and CSS classes are tinted after the cover.
+    bool cover_colors = false;
+    // Tracks listened to are logged to the listening history.
+    bool history = false;
+    // Synced lyrics of local files replace the track while a line is sung.
+    bool lyrics = false;
+    // Separates the runtime files of instances running side by side, e.g. one per output.
+    std::string instance;
+    // The instance is named after our PID: nothing can pick its files up once we
+    // exit, so they are removed then.
+    bool instance_per_process = false;
+};
+
+static Config config;
+
+static std::optional<std::string_view> option_value (std::string_view arg, std::string_view name) {
+    if (!arg.starts_with(name) || arg.size() <= name.size() || arg[name.size()] != '=') return std::nullopt;
+    return arg.substr(name.size() + 1);
+}
+
+static bool valid_instance_name (std::string_view name) {
+    return !name.empty() && name.find('/') == std::string_view::npos && name != "." && name != "..";
+}
+
+// Waybar starts one process per output, all with the same arguments, and tells
+// them apart by $WAYBAR_OUTPUT_NAME. Without it, our PID keeps us apart; a hot
+// upgrade keeps both.
+static std::string default_instance () {
+    const char* output = std::getenv("WAYBAR_OUTPUT_NAME");
+    if (output != nullptr && valid_instance_name(output)) return output;
+    return "pid-" + std::to_string(getpid());
+}
+
+static bool parse_uint_option (std::string_view arg, std::string_view name, guint& value) {
+    auto option = option_value(arg, name);
+    if (!option) return false;
+    std::string_view number = *option;
+    guint parsed = 0;
+    auto [end, ec] = std::from_chars(number.data(), number.data() + number.size(), parsed);
+    if (ec != std::errc{} || end != number.data() + number.size() || parsed == 0) {
+        std::cerr << "Invalid value for " << name << ": " << number << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    value = parsed;
+    return true;
+}
+
+static void parse_args (int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--album") {
+            config.show_album = true;
+            continue;
+        }
+        if (arg == "--cover-in-output") {
+            config.cover_in_output = true;
+            continue;
+        }
+        if (arg == "--cover-colors") {
+            config.cover_colors = true;
+            continue;
+        }
+        if (arg == "--history") {
+            config.history = true;
+            continue;
+        }
+        if (arg == "--lyrics") {
+            config.lyrics = true;
+            continue;
+        }
+        if (arg == "--no-prefetch") {
+            config.prefetch = false;
+            continue;
+        }
+        if (parse_uint_option(arg, "--scroll-interval", config.ac_profile.scroll_interval_ms)) continue;
+        if (parse_uint_option(arg, "--battery-scroll-interval", config.battery_profile.scroll_interval_ms)) continue;
+        if (parse_uint_option(arg, "--font-size", config.font_size_px)) continue;
+        if (parse_uint_option(arg, "--pixel-width", config.pixel_width)) continue;
+        if (auto path = option_value(arg, "--font")) {
+            config.font_path = *path;
+            continue;
+        }
+        if (auto instance = option_value(arg, "--instance")) {
+            if (!valid_instance_name(*instance)) {
+                std::cerr << "Invalid instance name: " << *instance << "\n";
+                std::exit(EXIT_FAILURE);
+            }
+            config.instance = *instance;
+            continue;
+        }
+        std::cerr << "Unknown option: " << arg << "\n";
+        std::exit(EXIT_FAILURE);
+    }
+    if (config.instance.empty()) {
+        config.instance = default_instance();
+        config.instance_per_process = config.instance.starts_with("pid-");
+    }
+    if (!config.font_path.empty() && (config.font_size_px == 0 || config.pixel_width == 0)) {
+        std::cerr << "--font requires --font-size and --pixel-width\n";
+        std::exit(EXIT_FAILURE);
+    }
+    // The scroll timer fires on whole timer wheel ticks; an interval between them
+    // would drift against the epoch and skip a step every so often.
+    static constexpr guint tick_ms = TimerWheel::tick_us / 1000;
+    for (RenderProfile* profile : {&config.ac_profile, &config.battery_profile}) {
+        profile->scroll_interval_ms = (profile->scroll_interval_ms + tick_ms - 1) / tick_ms * tick_ms;
+    }
+}
+
+static GHandle<GMainLoop> main_loop;
+
+// Upper bound between a termination signal and process exit.
+static constexpr unsigned shutdown_deadline_s = 2;
+
+// Set once termination has begun; a hot upgrade would outlive the deadline.
+static bool terminating = false;
+
+// Signals handled through the main loop. They stay blocked from a hot upgrade's
+// exec until the new image has installed its handlers, so none of them meets
+// its default action in between.
+static constexpr int main_loop_signals[] = {SIGINT, SIGTERM, SIGHUP, SIGUSR1};
+
+static void block_main_loop_signals (bool block) {
+    sigset_t set;
+    sigemptyset(&set);
+    for (int signal : main_loop_signals) sigaddset(&set, signal);
+    pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &set, nullptr);
+}
+
+// Dispatched from the main loop by g_unix_signal_add, not in signal context.
+// Repeats, e.g. SIGINT and SIGTERM in the same iteration, must not cut the
+// cleanup short; only the alarm forces an exit.
+static gboolean on_terminate_signal (gpointer) {
+    if (terminating) return G_SOURCE_CONTINUE;
+    terminating = true;
+    // SIGALRM's default action ends the process should the cleanup hang.
+    alarm(shutdown_deadline_s);
+    g_main_loop_quit(main_loop.get());
+    return G_SOURCE_CONTINUE;
+}
+
+// Player text ends up as Pango markup inside a JSON string, so both layers are
+// escaped in one pass. Each byte maps to an index into `escape_sequences`, 0 copies it.
+// Control characters are invalid in markup and become U+FFFD; input is valid UTF-8,
+// so bytes >= 0x80 pass through untouched.
+static constexpr std::string_view escape_sequences[] = {
+    {},
+    "&amp;", "&lt;", "&gt;", "&quot;", "&apos;",
+    "\\\\", "\\n", "\\t", "\\r",
+    "\xEF\xBF\xBD"
+};
+
+static constexpr std::array<uint8_t, 256> escape_actions = [] {
+    std::array<uint8_t, 256> actions{};
+    for (size_t c = 0; c < 0x20; c++) actions[c] = 10;
+    actions['&']  = 1;
+    actions['<']  = 2;
+    actions['>']  = 3;
+    actions['"']  = 4;
+    actions['\''] = 5;
+    actions['\\'] = 6;
+    actions['\n'] = 7;
+    actions['\t'] = 8;
+    actions['\r'] = 9;
+    return actions;
+}();
+
+void encode_into (std::string& buffer, std::string_view str) {
+    buffer.reserve(buffer.size() + str.size());
+    size_t run_start = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        uint8_t action = escape_actions[static_cast<unsigned char>(str[i])];
+        if (action == 0) continue;
+        buffer.append(str.data() + run_start, i - run_start);
+        buffer.append(escape_sequences[action]);
+        run_start = i + 1;
+    }
+    buffer.append(str.data() + run_start, str.size() - run_start);
+}
+
+// Plain JSON string escaping, for values that are not shown as markup.
+static void json_escape_into (std::string& buffer, std::string_view str) {
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            buffer.push_back('\\');
+            buffer.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            std::array<char, 7> escaped;
+            std::snprintf(escaped.data(), escaped.size(), "\\u%04x", c);
+            buffer.append(escaped.data(), 6);
+        } else {
+            buffer.push_back(c);
+        }
+    }
+}
+
+
+namespace fs = std::filesystem;
+
+// Runtime files of this instance. Lives on tmpfs, the disk cache only keeps what
+// is worth reusing across sessions.
+static fs::path instance_dir () {
+    return fs::path{g_get_user_runtime_dir()}/"mpris"/config.instance;
+}
+
+// The bar's image module reads the cover from here.
+static fs::path cover_link_path () {
+    return instance_dir()/"cover";
+}
+
+// With --cover-in-output, every cover version gets a name of its own in here.
+static fs::path cover_versions_dir () {
+    return instance_dir()/"covers";
+}
+
+// Set while a hot upgrade re-executes the binary, names the fd holding the state.
+static constexpr char state_fd_env[] = "MPRIS_STATE_FD";
+
+// Resolved at startup, /proc/self/exe points at the old inode once the binary is replaced.
+static fs::path self_exe;
+static char** self_argv = nullptr;
+
+static fs::path snapshot_path () {
+    return instance_dir()/"state.bin";
+}
+
+// The waybar process whose image module shows our cover: the nearest ancestor
+// named waybar, as its custom module may run us through a shell. 0 if there is
+// none.
+static pid_t find_waybar_pid () {
+    pid_t pid = getppid();
+    for (int depth = 0; depth < 4 && pid > 1; depth++) {
+        std::string proc = "/proc/" + std::to_string(pid) + "/stat";
+        gchar* contents = nullptr;
+        if (!handle_gfunc(g_file_get_contents, proc.c_str(), &contents, static_cast<gsize*>(nullptr))) return 0;
+        GHandle<gchar> owned{contents};
+        // "pid (comm) state ppid ...", comm may itself contain parentheses.
+        std::string_view stat = contents;
+        size_t open = stat.find('(');
+        size_t close = stat.rfind(')');
+        if (open == std::string_view::npos || close == std::string_view::npos || close < open) return 0;
+        if (stat.substr(open + 1, close - open - 1) == "waybar") return pid;
+        std::string_view rest = stat.substr(close + 1);
+        // " S 1234 ..."
+        if (rest.size() < 4) return 0;
+        rest.remove_prefix(3);
+        pid_t parent = 0;
+        auto [end, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), parent);
+        if (ec != std::errc{}) return 0;
+        pid = parent;
+    }
+    return 0;
+}
+
+// Last rendered state, persisted so a restarted instance can put it on the bar
+// before player discovery has even started.
+struct Snapshot {
+    static constexpr uint32_t magic = 0x5352504d; // "MPRS"
+    static constexpr uint32_t version = 4;
+
+    PlayerUID player;
+    bool is_playing = false;
+    int64_t scroll_epoch_us = 0;
+    std::string title;
+    std::string artist;
+    std::string album;
+    std::string art_url;
+    // Field texts as displayed, the layout is rebuilt from them.
+    std::vector<std::string> fields;
+    std::string frame;
+
+    std::string serialize () const {
+        std::string out;
+        auto put_u64 = [&out](uint64_t v) { out.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+        auto put_str = [&](std::string_view v) { put_u64(v.size()); out.append(v); };
+        put_u64((static_cast<uint64_t>(version) << 32) | magic);
+        put_u64(static_cast<uint64_t>(player.source));
+        put_u64(is_playing ? 1 : 0);
+        put_u64(static_cast<uint64_t>(scroll_epoch_us));
+        put_str(player.name);
+        put_str(title);
+        put_str(artist);
+        put_str(album);
+        put_str(art_url);
+        put_u64(fields.size());
+        for (const auto& field : fields) put_str(field);
+        put_str(frame);
+        return out;
+    }
+
+    static std::optional<Snapshot> parse (std::string_view in) {
+        bool ok = true;
+        auto get_u64 = [&]() -> uint64_t {
+            uint64_t v = 0;
+            if (in.size() < sizeof(v)) {
+                ok = false;
+                return 0;
+            }
+            std::memcpy(&v, in.data(), sizeof(v));
+            in.remove_prefix(sizeof(v));
+            return v;
+        };
+        auto get_str = [&]() -> std::string {
+            uint64_t size = get_u64();
+            if (size > in.size()) {
+                ok = false;
+                return {};
+            }
+            std::string v{in.substr(0, size)};
+            in.remove_prefix(size);
+            return v;
+        };
+
+        if (get_u64() != ((static_cast<uint64_t>(version) << 32) | magic)) return std::nullopt;
+        Snapshot snapshot;
+        snapshot.player.source = static_cast<PlayerctlSource>(get_u64());
+        snapshot.is_playing = get_u64() & 1;
+        snapshot.scroll_epoch_us = static_cast<int64_t>(get_u64());
+        snapshot.player.name = get_str();
+        snapshot.title = get_str();
+        snapshot.artist = get_str();
+        snapshot.album = get_str();
+        snapshot.art_url = get_str();
+        uint64_t field_count = get_u64();
+        for (uint64_t i = 0; ok && i < field_count; i++) {
+            snapshot.fields.push_back(get_str());
+        }
+        snapshot.frame = get_str();
+        if (!ok) return std::nullopt;
+        return snapshot;
+    }
+
+    static std::optional<Snapshot> load (const fs::path& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return std::nullopt;
+        auto snapshot = load(fd);
+        close(fd);
+        return snapshot;
+    }
+
+    static std::optional<Snapshot> load (int fd) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) return std::nullopt;
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) return std::nullopt;
+        auto snapshot = parse({static_cast<const char*>(data), static_cast<size_t>(st.st_size)});
+        munmap(data, st.st_size);
+        return snapshot;
+    }
+
+    // Handed to a re-executed image. The memfd is deliberately inheritable.
+    int to_memfd () const {
+        std::string data = serialize();
+        int fd = memfd_create("mpris-state", 0);
+        if (fd < 0) return -1;
+        if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Written to a temporary file and renamed, so readers never see a partial snapshot.
+    bool save (const fs::path& path) const {
+        std::string data = serialize();
+        fs::path tmp_path = path;
+        tmp_path += "." + std::to_string(getpid());
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size());
+        ok = close(fd) == 0 && ok;
+        if (ok) ok = rename(tmp_path.c_str(), path.c_str()) == 0;
+        if (!ok) unlink(tmp_path.c_str());
+        return ok;
+    }
+};
+
+// Read-only private mapping of a whole file.
+class MappedFile : UniqueOnly {
+public:
+    static Result<std::unique_ptr<MappedFile>> open (const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return std::unexpected(Error{path + ": " + std::strerror(errno)});
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return std::unexpected(Error{path + ": empty or unreadable"});
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int mmap_errno = errno;
+        close(fd);
+        if (data == MAP_FAILED) return std::unexpected(Error{path + ": " + std::strerror(mmap_errno)});
+        // Tags are reached by a few jumps, read ahead would only pull in audio.
+        madvise(data, st.st_size, MADV_RANDOM);
+        return std::unique_ptr<MappedFile>{new MappedFile{{static_cast<const char*>(data), static_cast<size_t>(st.st_size)}}};
+    }
+
+    ~MappedFile () {
+        munmap(const_cast<char*>(bytes.data()), bytes.size());
+    }
+
+    const std::string_view bytes;
+
+private:
+    MappedFile (std::string_view bytes) : bytes(bytes) {}
+};
+
+// Bounds checked cursor over untrusted bytes. Reading past the end yields zeros
+// and empty views and clears `ok`, so parsers check once after a group of reads.
+struct ByteReader {
+    std::string_view data;
+    size_t pos = 0;
+    bool ok = true;
+
+    size_t remaining () const { return data.size() - pos; }
+
+    std::string_view take (uint64_t n) {
+        if (!ok || n > remaining()) {
+            ok = false;
+            return {};
+        }
+        std::string_view taken = data.substr(pos, n);
+        pos += n;
+        return taken;
+    }
+
+    uint64_t be (size_t n) {
+        uint64_t value = 0;
+        for (unsigned char c : take(n)) value = (value << 8) | c;
+        return value;
+    }
+
+    uint32_t le32 () {
+        uint32_t value = 0;
+        std::string_view bytes = take(4);
+        for (size_t i = bytes.size(); i > 0; i--) value = (value << 8) | static_cast<unsigned char>(bytes[i - 1]);
+        return value;
+    }
+
+    uint8_t u8 () { return static_cast<uint8_t>(be(1)); }
+    uint32_t be32 () { return static_cast<uint32_t>(be(4)); }
+
+    // ID3v2 sizes keep 7 bits per byte.
+    uint32_t syncsafe32 () {
+        uint32_t value = 0;
+        for (unsigned char c : take(4)) value = (value << 7) | (c & 0x7F);
+        return value;
+    }
+};
+
+// Files may carry several pictures, the front cover wins over whatever came first.
+struct PictureChoice {
+    std::string_view data;
+    bool front = false;
+
+    void offer (std::string_view picture, bool is_front) {
+        if (picture.empty() || front || (!data.empty() && !is_front)) return;
+        data = picture;
+        front = is_front;
+    }
+
+    // The body of a FLAC PICTURE block, also used base64 encoded by Ogg.
+    void offer_flac_block (std::string_view block) {
+        ByteReader r{block};
+        uint32_t type = r.be32();
+        r.take(r.be32()); // MIME type
+        r.take(r.be32()); // description
+        r.take(16);       // width, height, depth, colors
+        std::string_view picture = r.take(r.be32());
+        if (r.ok) offer(picture, type == 3);
+    }
+};
+
+// Calls `visit(type, body)` for each metadata block of a FLAC file. The blocks
+// precede the frames and the last one is flagged, so audio is never reached.
+template <typename Visit>
+static void for_each_flac_block (std::string_view file, Visit&& visit) {
+    if (!file.starts_with("fLaC")) return;
+    ByteReader r{file, 4};
+    for (bool last = false; !last && r.ok;) {
+        uint32_t header = r.be32();
+        last = (header & 0x80000000) != 0;
+        std::string_view block = r.take(header & 0xFFFFFF);
+        if (r.ok) visit(static_cast<uint8_t>((header >> 24) & 0x7F), block);
+    }
+}
+
+static std::string_view flac_picture (std::string_view file) {
+    PictureChoice choice;
+    for_each_flac_block(file, [&](uint8_t type, std::string_view block) {
+        if (type == 6) choice.offer_flac_block(block);
+    });
+    return choice.data;
+}
+
+// Skips a text field of an ID3v2 frame, terminated according to its encoding.
+static void skip_id3_string (ByteReader& r, uint8_t encoding) {
+    bool wide = encoding == 1 || encoding == 2;
+    size_t step = wide ? 2 : 1;
+    std::string_view rest = r.data.substr(std::min(r.pos, r.data.size()));
+    for (size_t i = 0; i + step <= rest.size(); i += step) {
+        if (rest[i] == 0 && (!wide || rest[i + 1] == 0)) {
+            r.take(i + step);
+            return;
+        }
+    }
+    r.ok = false;
+}
+
+// Calls `visit(id, major, frame)` for each ID3v2 frame at the start of `file`
+// that is stored as is; compressed and encrypted frames are left out. Ids are
+// three characters in v2.2 and four in later versions.
+template <typename Visit>
+static void for_each_id3_frame (std::string_view file, Visit&& visit) {
+    if (file.size() < 10 || !file.starts_with("ID3")) return;
+    uint8_t major = file[3];
+    uint8_t flags = file[5];
+    // Unsynchronised tags would have to be rewritten before frames are usable.
+    if (major < 2 || major > 4 || (flags & 0x80) != 0) return;
+    ByteReader header{file, 6};
+    size_t size = header.syncsafe32();
+    ByteReader r{file.substr(0, std::min(file.size(), 10 + size)), 10};
+    if ((flags & 0x40) != 0 && major >= 3) {
+        // The extended header's size excludes itself in v2.3 only.
+        r.take(major == 3 ? r.be32() : r.syncsafe32() - 4);
+    }
+
+    size_t id_size = major == 2 ? 3 : 4;
+    while (r.ok && r.remaining() > id_size) {
+        std::string_view id = r.take(id_size);
+        if (id[0] == 0) break; // padding
+        uint32_t frame_size = major == 2 ? r.be(3) : major == 3 ? r.be32() : r.syncsafe32();
+        uint16_t frame_flags = major == 2 ? 0 : r.be(2);
+        ByteReader frame{r.take(frame_size)};
+        if (!r.ok) break;
+        if (major == 3) {
+            if ((frame_flags & 0xC0) != 0) continue; // compressed or encrypted
+            if ((frame_flags & 0x20) != 0) frame.take(1);
+        } else if (major == 4) {
+            if ((frame_flags & 0x0E) != 0) continue; // compressed, encrypted or unsynchronised
+            if ((frame_flags & 0x40) != 0) frame.take(1);
+            if ((frame_flags & 0x01) != 0) frame.take(4);
+        }
+        visit(id, major, frame);
+    }
+}
+
+static std::string_view id3_picture (std::string_view file) {
+    PictureChoice choice;
+    for_each_id3_frame(file, [&](std::string_view id, uint8_t major, ByteReader& frame) {
+        if (id != (major == 2 ? "PIC" : "APIC")) return;
+        uint8_t encoding = frame.u8();
+        if (major == 2) {
+            frame.take(3); // image format
+        } else {
+            skip_id3_string(frame, 0); // MIME type, always Latin-1
+        }
+        uint8_t type = frame.u8();
+        skip_id3_string(frame, encoding);
+        if (frame.ok) choice.offer(frame.data.substr(frame.pos), type == 3);
+    });
+    return choice.data;
+}
+
+// Body of the first box of `type` directly inside `container`. Boxes that are
+// skipped, mdat in particular, are never touched.
+static std::string_view mp4_box (std::string_view container, std::string_view type) {
+    ByteReader r{container};
+    while (r.ok && r.remaining() >= 8) {
+        uint64_t size = r.be32();
+        std::string_view name = r.take(4);
+        uint64_t header = 8;
+        if (size == 1) {
+            size = r.be(8);
+            header = 16;
+        } else if (size == 0) {
+            size = header + r.remaining();
+        }
+        if (size < header) return {};
+        std::string_view body = r.take(size - header);
+        if (r.ok && name == type) return body;
+    }
+    return {};
+}
+
+static std::string_view mp4_picture (std::string_view file) {
+    if (file.size() < 8 || file.substr(4, 4) != "ftyp") return {};
+    std::string_view udta = mp4_box(mp4_box(file, "moov"), "udta");
+    std::string_view meta = mp4_box(udta, "meta");
+    if (meta.size() < 4) return {};
+    std::string_view covr = mp4_box(mp4_box(meta.substr(4), "ilst"), "covr");
+    std::string_view data = mp4_box(covr, "data");
+    // Type indicator and locale precede the image.
+    return data.size() > 8 ? data.substr(8) : std::string_view{};
+}
+
+// The Vorbis comment block of an Ogg Vorbis or Opus file: the second packet of
+// the first logical stream, which may span pages.
+static std::optional<std::string> ogg_comment_block (std::string_view file) {
+    static constexpr size_t max_packet = 64 << 20;
+    if (!file.starts_with("OggS")) return std::nullopt;
+    ByteReader r{file};
+    std::string packet;
+    std::string_view serial;
+    int packets = 0;
+    while (r.ok && packets < 2) {
+        std::string_view page = r.take(27);
+        if (!r.ok || !page.starts_with("OggS")) return std::nullopt;
+        std::string_view table = r.take(static_cast<unsigned char>(page[26]));
+        if (serial.empty()) serial = page.substr(14, 4);
+        bool ours = page.substr(14, 4) == serial;
+        for (unsigned char lacing : table) {
+            std::string_view segment = r.take(lacing);
+            if (!ours) continue;
+            if (packets == 1) packet.append(segment);
+            if (lacing < 255 && ++packets == 2) break;
+        }
+        if (packet.size() > max_packet) return std::nullopt;
+    }
+    if (packets < 2) return std::nullopt;
+    if (packet.starts_with("\x03vorbis")) {
+        packet.erase(0, 7);
+    } else if (packet.starts_with("OpusTags")) {
+        packet.erase(0, 8);
+    } else {
+        return std::nullopt;
+    }
+    return packet;
+}
+
+// Calls `visit(value)` for every comment named `key` in a Vorbis comment block,
+// as found in Ogg streams and FLAC VORBIS_COMMENT blocks.
+template <typename Visit>
+static void for_each_vorbis_comment (std::string_view block, std::string_view key, Visit&& visit) {
+    ByteReader c{block};
+    c.take(c.le32()); // vendor
+    for (uint32_t count = c.le32(); c.ok && count > 0; count--) {
+        std::string_view comment = c.take(c.le32());
+        if (comment.size() <= key.size() || comment[key.size()] != '=') continue;
+        if (g_ascii_strncasecmp(comment.data(), key.data(), key.size()) != 0) continue;
+        visit(comment.substr(key.size() + 1));
+    }
+}
+
+static std::optional<std::string> ogg_picture (std::string_view file) {
+    auto comments = ogg_comment_block(file);
+    if (!comments) return std::nullopt;
+    std::optional<std::string> best;
+    bool best_front = false;
+    for_each_vorbis_comment(*comments, "METADATA_BLOCK_PICTURE", [&](std::string_view value) {
+        std::string block{value};
+        gsize length = 0;
+        g_base64_decode_inplace(block.data(), &length);
+        block.resize(length);
+        PictureChoice choice;
+        choice.offer_flac_block(block);
+        if (choice.data.empty() || best_front || (best && !choice.front)) return;
+        best.emplace(choice.data);
+        best_front = choice.front;
+    });
+    return best;
+}
+
+// Picture embedded in a local audio file. Borrowed from the mapping where the
+// container stores it verbatim, decoded into `decoded` where it does not (Ogg).
+struct EmbeddedCover {
+    std::unique_ptr<MappedFile> file;
+    std::string decoded;
+    size_t offset = 0;
+    size_t length = 0;
+
+    std::string_view data () const {
+        return decoded.empty() ? file->bytes.substr(offset, length) : std::string_view{decoded};
+    }
+};
+
+// Finds the cover in the tags of `path` without reading the audio payload.
+static Result<std::optional<EmbeddedCover>> read_embedded_cover (const std::string& path) {
+    auto file = MappedFile::open(path);
+    if (!file) return std::unexpected(file.error());
+    EmbeddedCover cover{std::move(*file)};
+    std::string_view bytes = cover.file->bytes;
+    std::string_view picture = flac_picture(bytes);
+    if (picture.empty()) picture = id3_picture(bytes);
+    if (picture.empty()) picture = mp4_picture(bytes);
+    if (!picture.empty()) {
+        cover.offset = picture.data() - bytes.data();
+        cover.length = picture.size();
+        return cover;
+    }
+    if (auto decoded = ogg_picture(bytes)) {
+        cover.decoded = std::move(*decoded);
+        return cover;
+    }
+    return std::nullopt;
+}
+
+// Time-synced lyrics, sorted by start time.
+struct Lyrics {
+    struct Line {
+        gint64 start_us;
+        std::string text;
+    };
+    std::vector<Line> lines;
+
+    static constexpr size_t none = std::numeric_limits<size_t>::max();
+
+    // Index of the line sung at `position_us`, `none` before the first one.
+    size_t line_at (gint64 position_us) const {
+        auto next = std::ranges::upper_bound(lines, position_us, {}, &Line::start_us);
+        return next == lines.begin() ? none : static_cast<size_t>(next - lines.begin() - 1);
+    }
+};
+
+// [mm:ss], [mm:ss.x], [mm:ss.xx], [mm:ss.xxx] or [mm:ss:xx], without the brackets.
+static std::optional<gint64> parse_lrc_timestamp (std::string_view tag) {
+    auto number = [&](size_t max_digits, size_t& digits) -> std::optional<gint64> {
+        gint64 value = 0;
+        auto [end, ec] = std::from_chars(tag.data(), tag.data() + std::min(tag.size(), max_digits), value);
+        if (ec != std::errc{} || value < 0) return std::nullopt;
+        digits = end - tag.data();
+        tag.remove_prefix(digits);
+        return value;
+    };
+    size_t digits = 0;
+    auto minutes = number(4, digits);
+    if (!minutes || !tag.starts_with(':')) return std::nullopt;
+    tag.remove_prefix(1);
+    auto seconds = number(2, digits);
+    if (!seconds || digits != 2) return std::nullopt;
+    gint64 start_us = (*minutes * 60 + *seconds) * G_USEC_PER_SEC;
+    if (tag.empty()) return start_us;
+    if (tag[0] != '.' && tag[0] != ':') return std::nullopt;
+    tag.remove_prefix(1);
+    auto fraction = number(3, digits);
+    if (!fraction || !tag.empty()) return std::nullopt;
+    for (size_t i = digits; i < 6; i++) *fraction *= 10;
+    return start_us + *fraction;
+}
+
+static Lyrics parse_lrc (std::string_view text) {
+    Lyrics lyrics;
+    gint64 offset_ms = 0;
+    while (!text.empty()) {
+        size_t eol = text.find('\n');
+        std::string_view line = text.substr(0, eol);
+        text.remove_prefix(eol == std::string_view::npos ? text.size() : eol + 1);
+        if (line.ends_with('\r')) line.remove_suffix(1);
+
+        std::vector<gint64> starts;
+        while (line.starts_with('[')) {
+            size_t close = line.find(']');
+            if (close == std::string_view::npos) break;
+            std::string_view tag = line.substr(1, close - 1);
+            if (auto start = parse_lrc_timestamp(tag)) {
+                starts.push_back(*start);
+            } else if (tag.starts_with("offset:")) {
+                std::string_view value = tag.substr(7);
+                if (value.starts_with('+')) value.remove_prefix(1);
+                std::from_chars(value.data(), value.data() + value.size(), offset_ms);
+            }
+            line.remove_prefix(close + 1);
+        }
+        if (starts.empty()) continue;
+        while (line.starts_with(' ')) line.remove_prefix(1);
+        std::string content = sanitized_utf8(std::string{line});
+        for (gint64 start : starts) lyrics.lines.push_back({start, content});
+    }
+    // A positive offset makes lines appear sooner.
+    for (auto& line : lyrics.lines) {
+        line.start_us = std::max<gint64>(0, line.start_us - offset_ms * 1000);
+    }
+    std::ranges::stable_sort(lyrics.lines, {}, &Lyrics::Line::start_us);
+    return lyrics;
+}
+
+static std::string id3_text (std::string_view raw, uint8_t encoding) {
+    static constexpr const char* charsets[] = {"ISO-8859-1", "UTF-16", "UTF-16BE"};
+    if (encoding >= std::size(charsets)) return sanitized_utf8(std::string{raw});
+    auto converted = handle_gfunc(
+        g_convert, raw.data(), static_cast<gssize>(raw.size()), "UTF-8", charsets[encoding],
+        static_cast<gsize*>(nullptr), static_cast<gsize*>(nullptr)
+    );
+    if (!converted) return {};
+    GHandle<gchar> owned{*converted};
+    return sanitized_utf8(std::string{owned.get()});
+}
+
+// ID3v2 SYLT frame. Only millisecond timestamps are supported, MPEG frame
+// numbers would need the audio's frame rate.
+static Lyrics parse_sylt (ByteReader& frame) {
+    Lyrics lyrics;
+    uint8_t encoding = frame.u8();
+    frame.take(3); // language
+    uint8_t timestamp_format = frame.u8();
+    frame.u8(); // content type
+    skip_id3_string(frame, encoding);
+    if (!frame.ok || timestamp_format != 2) return lyrics;
+    size_t terminator = encoding == 1 || encoding == 2 ? 2 : 1;
+    while (frame.ok && frame.remaining() > 0) {
+        size_t start = frame.pos;
+        skip_id3_string(frame, encoding);
+        if (!frame.ok) break;
+        std::string_view raw = frame.data.substr(start, frame.pos - start - terminator);
+        gint64 start_ms = frame.be32();
+        if (!frame.ok) break;
+        std::string text = id3_text(raw, encoding);
+        // Entries conventionally start a new line with a newline.
+        while (text.starts_with('\n') || text.starts_with('\r')) text.erase(0, 1);
+        lyrics.lines.push_back({start_ms * 1000, std::move(text)});
+    }
+    std::ranges::stable_sort(lyrics.lines, {}, &Lyrics::Line::start_us);
+    return lyrics;
+}
+
+// SYLT, or LRC text in USLT or a LYRICS comment, in a file's tags.
+static std::optional<Lyrics> tag_lyrics (std::string_view bytes) {
+    Lyrics lyrics;
+    for_each_id3_frame(bytes, [&](std::string_view id, uint8_t major, ByteReader& frame) {
+        if (!lyrics.lines.empty()) return;
+        if (id == (major == 2 ? "SLT" : "SYLT")) {
+            lyrics = parse_sylt(frame);
+        } else if (id == (major == 2 ? "ULT" : "USLT")) {
+            uint8_t encoding = frame.u8();
+            frame.take(3); // language
+            skip_id3_string(frame, encoding);
+            if (frame.ok) lyrics = parse_lrc(id3_text(frame.data.substr(frame.pos), encoding));
+        }
+    });
+    auto from_comments = [&](std::string_view block) {
+        for_each_vorbis_comment(block, "LYRICS", [&](std::string_view value) {
+            if (lyrics.lines.empty()) lyrics = parse_lrc(value);
+        });
+    };
+    for_each_flac_block(bytes, [&](uint8_t type, std::string_view block) {
+        if (type == 4) from_comments(block);
+    });
+    if (lyrics.lines.empty()) {
+        if (auto block = ogg_comment_block(bytes)) from_comments(*block);
+    }
+    if (lyrics.lines.empty()) return std::nullopt;
+    return lyrics;
+}
+
+// A sidecar .lrc next to the file first, then the file's own tags.
+static std::optional<Lyrics> load_lyrics (const std::string& path) {
+    if (auto sidecar = MappedFile::open(fs::path{path}.replace_extension(".lrc").string())) {
+        Lyrics lyrics = parse_lrc((*sidecar)->bytes);
+        if (!lyrics.lines.empty()) return lyrics;
+    }
+    auto file = MappedFile::open(path);
+    if (!file) return std::nullopt;
+    return tag_lyrics((*file)->bytes);
+}
+
+static Result<std::string> file_uri_path (const std::string& uri) {
+    auto path = handle_gfunc(g_filename_from_uri, uri.c_str(), static_cast<gchar**>(nullptr));
+    if (!path) return std::unexpected(path.error());
+    GHandle<gchar> owned{*path};
+    return std::string{owned.get()};
+}
+
+// Players escape URIs in their own ways; the thumbnail spec keys on the URI
+// GLib builds from the path, as file managers do.
+static Result<std::string> path_file_uri (const std::string& path) {
+    auto uri = handle_gfunc(g_filename_to_uri, path.c_str(), static_cast<const gchar*>(nullptr));
+    if (!uri) return std::unexpected(uri.error());
+    GHandle<gchar> owned{*uri};
+    return std::string{owned.get()};
+}
+
+// Covers produced by us rather than the player, named after a hash of their
+// content: identical covers are stored once and a published name never changes.
+static fs::path cover_store_dir () {
+    return fs::path{g_get_user_cache_dir()}/"mpris-covers";
+}
+
+static std::string_view image_extension (std::string_view data) {
+    if (data.starts_with("\x89PNG")) return "png";
+    if (data.starts_with("\xFF\xD8")) return "jpg";
+    if (data.starts_with("GIF8")) return "gif";
+    if (data.starts_with("RIFF") && data.substr(8, 4) == "WEBP") return "webp";
+    return "img";
+}
+
+static Result<void> write_all (int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return std::unexpected(Error{std::strerror(errno)});
+        }
+        data.remove_prefix(written);
+    }
+    return {};
+}
+
+// Where `data` lives in the cover store.
+static fs::path cover_store_entry (std::string_view data) {
+    GHandle<gchar> hash{g_compute_checksum_for_data(G_CHECKSUM_SHA1, reinterpret_cast<const guchar*>(data.data()), data.size())};
+    return cover_store_dir()/(std::string{hash.get()} + "." + std::string{image_extension(data)});
+}
+
+// Written to a temporary file and renamed, so readers never see a partial image.
+static Result<fs::path> store_cover (std::string_view data) {
+    fs::path dir = cover_store_dir();
+    fs::path path = cover_store_entry(data);
+    std::error_code ec;
+    // Already stored: marked as used instead, for the sweep.
+    if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0) return path;
+    fs::create_directories(dir, ec);
+    if (ec) return std::unexpected(Error{dir.string() + ": " + ec.message()});
+
+    std::string tmp_path = path.string() + ".XXXXXX";
+    int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (fd < 0) return std::unexpected(Error{tmp_path + ": " + std::strerror(errno)});
+    auto written = write_all(fd, data);
+    if (close(fd) != 0 && written) written = std::unexpected(Error{std::strerror(errno)});
+    if (written && rename(tmp_path.c_str(), path.c_str()) != 0) written = std::unexpected(Error{std::strerror(errno)});
+    if (!written) {
+        unlink(tmp_path.c_str());
+        return std::unexpected(Error{path.string() + ": " + written.error().message});
+    }
+    return path;
+}
+
+// Copies all of `source` into the empty `target`: a reflink shares the extents on
+// CoW filesystems, copy_file_range copies inside the kernel elsewhere and plain
+// reads and writes are the last resort.
+static Result<void> copy_file_contents (int source, int target) {
+    if (ioctl(target, FICLONE, source) == 0) return {};
+    bool copied_any = false;
+    while (true) {
+        ssize_t copied = copy_file_range(source, nullptr, target, nullptr, 1 << 30, 0);
+        if (copied == 0) return {};
+        if (copied > 0) {
+            copied_any = true;
+            continue;
+        }
+        if (errno == EINTR) continue;
+        // Unsupported for this pair of files, fall back as long as nothing was written.
+        if (copied_any || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)) {
+            return std::unexpected(Error{std::strerror(errno)});
+        }
+        break;
+    }
+    std::array<char, 64 * 1024> buffer;
+    while (true) {
+        ssize_t n = read(source, buffer.data(), buffer.size());
+        if (n == 0) return {};
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return std::unexpected(Error{std::strerror(errno)});
+        }
+        auto written = write_all(target, {buffer.data(), static_cast<size_t>(n)});
+        if (!written) return written;
+    }
+}
+
+struct CoverSnapshot {
+    fs::path path;
+    // Of the source as it was copied, for anything derived from the copy.
+    time_t source_mtime = 0;
+};
+
+// Takes a private copy of a cover the player may delete or rewrite at any time.
+// A copy that raced with a writer is retried. The copy is hashed, never the
+// source, so the published name always matches what it contains, and repeats
+// of a cover already stored are dropped.
+static Result<CoverSnapshot> snapshot_cover (const std::string& path) {
+    static constexpr int attempts = 3;
+    fs::path dir = cover_store_dir();
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) return std::unexpected(Error{dir.string() + ": " + ec.message()});
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        int source = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (source < 0) return std::unexpected(Error{path + ": " + std::strerror(errno)});
+        struct stat before;
+        struct stat after;
+        std::string tmp_path = (dir/"snapshot.XXXXXX").string();
+        int target = mkostemp(tmp_path.data(), O_CLOEXEC);
+        if (target < 0) {
+            close(source);
+            return std::unexpected(Error{tmp_path + ": " + std::strerror(errno)});
+        }
+        fstat(source, &before);
+        auto copied = copy_file_contents(source, target);
+        fstat(source, &after);
+        close(source);
+        if (close(target) != 0 && copied) copied = std::unexpected(Error{std::strerror(errno)});
+        bool stable = before.st_size == after.st_size
+            && before.st_mtim.tv_sec == after.st_mtim.tv_sec
+            && before.st_mtim.tv_nsec == after.st_mtim.tv_nsec;
+        if (!copied || !stable) {
+            unlink(tmp_path.c_str());
+            if (!copied) return std::unexpected(Error{path + ": " + copied.error().message});
+            continue;
+        }
+
+        auto snapshot = MappedFile::open(tmp_path);
+        if (!snapshot) {
+            unlink(tmp_path.c_str());
+            return std::unexpected(snapshot.error());
+        }
+        fs::path entry = cover_store_entry((*snapshot)->bytes);
+        if (utimensat(AT_FDCWD, entry.c_str(), nullptr, 0) == 0) {
+            unlink(tmp_path.c_str());
+        } else if (rename(tmp_path.c_str(), entry.c_str()) != 0) {
+            int rename_errno = errno;
+            unlink(tmp_path.c_str());
+            return std::unexpected(Error{entry.string() + ": " + std::strerror(rename_errno)});
+        }
+        return CoverSnapshot{std::move(entry), after.st_mtime};
+    }
+    return std::unexpected(Error{path + ": kept changing while being copied"});
+}
+
+// The store is swept least recently used first: storing an entry, or finding
+// it stored already, touches it.
+// Entries used lately are kept whatever the size, another instance may be
+// showing them, and so are snapshots still being written.
+static constexpr uintmax_t cover_store_max_bytes = 64 << 20;
+static constexpr auto cover_store_max_age = std::chrono::days{30};
+static constexpr auto cover_store_min_age = std::chrono::hours{1};
+
+static Result<size_t> sweep_cover_store (const fs::path& keep) {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type used;
+        uintmax_t size;
+    };
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+    std::error_code ec;
+    // Advanced by hand: the range-for increment throws, and in a worker that ends
+    // the process.
+    for (fs::directory_iterator it{cover_store_dir(), ec}; !ec && it != fs::directory_iterator{}; it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        std::error_code entry_ec;
+        if (!entry.is_regular_file(entry_ec)) continue;
+        auto used = entry.last_write_time(entry_ec);
+        auto size = entry.file_size(entry_ec);
+        if (entry_ec) continue;
+        entries.push_back({entry.path(), used, size});
+        total += size;
+    }
+    if (ec) {
+        if (ec == std::errc::no_such_file_or_directory) return 0;
+        return std::unexpected(Error{cover_store_dir().string() + ": " + ec.message()});
+    }
+
+    std::ranges::sort(entries, {}, &Entry::used);
+    auto now = fs::file_time_type::clock::now();
+    size_t removed = 0;
+    for (const auto& entry : entries) {
+        auto age = now - entry.used;
+        if (age < cover_store_min_age) break;
+        if (total <= cover_store_max_bytes && age < cover_store_max_age) break;
+        if (entry.path == keep) continue;
+        if (fs::remove(entry.path, ec)) {
+            total -= entry.size;
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// Thumbnails shared with file managers, per the freedesktop thumbnail spec.
+static constexpr int thumbnail_normal_size = 128;
+
+static fs::path thumbnail_path (const std::string& uri, std::string_view size) {
+    GHandle<gchar> md5{g_compute_checksum_for_string(G_CHECKSUM_MD5, uri.c_str(), -1)};
+    return fs::path{g_get_user_cache_dir()}/"thumbnails"/size/(std::string{md5.get()} + ".png");
+}
+
+// A thumbnail is only valid for the exact file version it was made from.
+static bool thumbnail_is_fresh (const fs::path& thumbnail, const std::string& uri, time_t mtime) {
+    auto file = MappedFile::open(thumbnail);
+    if (!file) return false;
+    std::string_view png = (*file)->bytes;
+    if (!png.starts_with("\x89PNG\r\n\x1a\n")) return false;
+    ByteReader r{png, 8};
+    std::string mtime_text = std::to_string(mtime);
+    bool uri_matches = false;
+    bool mtime_matches = false;
+    while (r.ok && !(uri_matches && mtime_matches)) {
+        uint32_t length = r.be32();
+        std::string_view type = r.take(4);
+        std::string_view data = r.take(length);
+        r.take(4); // CRC
+        if (!r.ok || type == "IEND") break;
+        if (type != "tEXt") continue;
+        size_t separator = data.find('\0');
+        if (separator == std::string_view::npos) continue;
+        std::string_view key = data.substr(0, separator);
+        std::string_view value = data.substr(separator + 1);
+        if (key == "Thumb::URI") uri_matches = value == uri;
+        if (key == "Thumb::MTime") mtime_matches = value == mtime_text;
+    }
+    return uri_matches && mtime_matches;
+}
+
+// Writes a normal size thumbnail back into the shared cache, so later runs and
+// other applications find it. Images no larger than that are used as they are.
+static Result<fs::path> generate_thumbnail (const std::string& path, const std::string& uri, time_t mtime) {
+    gint width = 0;
+    gint height = 0;
+    if (gdk_pixbuf_get_file_info(path.c_str(), &width, &height) == nullptr) {
+        return std::unexpected(Error{path + ": unknown image format"});
+    }
+    if (width <= thumbnail_normal_size && height <= thumbnail_normal_size) return fs::path{path};
+
+    auto scaled = handle_gfunc(gdk_pixbuf_new_from_file_at_size, path.c_str(), thumbnail_normal_size, thumbnail_normal_size);
+    if (!scaled) return std::unexpected(scaled.error());
+    GHandle<GdkPixbuf> pixbuf{*scaled};
+
+    fs::path thumbnail = thumbnail_path(uri, "normal");
+    if (g_mkdir_with_parents(thumbnail.parent_path().c_str(), 0700) != 0) {
+        return std::unexpected(Error{thumbnail.parent_path().string() + ": " + std::strerror(errno)});
+    }
+    // mkstemp creates the file 0600, as the spec asks for.
+    std::string tmp_path = thumbnail.string() + ".XXXXXX";
+    int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (fd < 0) return std::unexpected(Error{tmp_path + ": " + std::strerror(errno)});
+    close(fd);
+
+    std::string mtime_text = std::to_string(mtime);
+    std::array<char*, 3> keys{const_cast<char*>("tEXt::Thumb::URI"), const_cast<char*>("tEXt::Thumb::MTime"), nullptr};
+    std::array<char*, 3> values{const_cast<char*>(uri.c_str()), mtime_text.data(), nullptr};
+    auto saved = handle_gfunc(gdk_pixbuf_savev, pixbuf.get(), tmp_path.c_str(), "png", keys.data(), values.data());
+    if (!saved || rename(tmp_path.c_str(), thumbnail.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return std::unexpected(saved ? Error{thumbnail.string() + ": " + std::strerror(errno)} : saved.error());
+    }
+    return thumbnail;
+}
+
+// Identifies one version of a cover file by its path, mtime and size.
+static Result<std::string> cover_version_key (const fs::path& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return std::unexpected(Error{path.string() + ": " + std::strerror(errno)});
+    }
+    std::string key = path.string() + "\n" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec)
+        + "\n" + std::to_string(st.st_size);
+    GHandle<gchar> hash{g_compute_checksum_for_string(G_CHECKSUM_SHA1, key.c_str(), -1)};
+    return std::string{hash.get()};
+}
+
+// Colours to tint the bar with, taken from the cover.
+struct CoverPalette {
+    // Most common colour of the cover, as 0xRRGGBB.
+    uint32_t dominant = 0;
+    uint32_t accent = 0;
+
+    bool dark () const {
+        // Rec. 601 luma, in 0..255000.
+        return 299 * (dominant >> 16) + 587 * ((dominant >> 8) & 0xFF) + 114 * (dominant & 0xFF) < 128000;
+    }
+
+    // Coarse hue of the accent, for CSS classes.
+    std::string_view hue () const {
+        int r = accent >> 16;
+        int g = (accent >> 8) & 0xFF;
+        int b = accent & 0xFF;
+        int max = std::max({r, g, b});
+        int min = std::min({r, g, b});
+        if (max == 0 || (max - min) * 5 < max) return "gray";
+        static constexpr std::string_view names[] = {"red", "yellow", "green", "cyan", "blue", "magenta"};
+        int hue = 0; // degrees
+        if (max == r) {
+            hue = (60 * (g - b) / (max - min) + 360) % 360;
+        } else if (max == g) {
+            hue = 60 * (b - r) / (max - min) + 120;
+        } else {
+            hue = 60 * (r - g) / (max - min) + 240;
+        }
+        return names[((hue + 30) / 60) % 6];
+    }
+};
+
+// Histogram over 4 bits per channel of a downscaled copy. The dominant colour is
+// the fullest bin, the accent the fullest one weighted by saturation that is
+// clearly distinct from it. The JPEG loader scales while decoding, other formats
+// are decoded at full size first; tests/bench/palette measures both.
+static Result<CoverPalette> compute_palette (const fs::path& image) {
+    static constexpr int sample_size = 64;
+    auto scaled = handle_gfunc(gdk_pixbuf_new_from_file_at_size, image.c_str(), sample_size, sample_size);
+    if (!scaled) return std::unexpected(scaled.error());
+    GHandle<GdkPixbuf> pixbuf{*scaled};
+    int width = gdk_pixbuf_get_width(pixbuf.get());
+    int height = gdk_pixbuf_get_height(pixbuf.get());
+    int channels = gdk_pixbuf_get_n_channels(pixbuf.get());
+    int stride = gdk_pixbuf_get_rowstride(pixbuf.get());
+    bool alpha = gdk_pixbuf_get_has_alpha(pixbuf.get());
+    const guint8* pixels = gdk_pixbuf_read_pixels(pixbuf.get());
+
+    struct Bin {
+        uint32_t count = 0;
+        uint32_t r = 0;
+        uint32_t g = 0;
+        uint32_t b = 0;
+
+        uint32_t mean () const {
+            return ((r / count) << 16) | ((g / count) << 8) | (b / count);
+        }
+    };
+    std::array<Bin, 4096> bins{};
+    for (int y = 0; y < height; y++) {
+        const guint8* row = pixels + static_cast<size_t>(y) * stride;
+        for (int x = 0; x < width; x++) {
+            const guint8* p = row + x * channels;
+            if (alpha && p[3] < 128) continue;
+            Bin& bin = bins[((p[0] >> 4) << 8) | ((p[1] >> 4) << 4) | (p[2] >> 4)];
+            bin.count++;
+            bin.r += p[0];
+            bin.g += p[1];
+            bin.b += p[2];
+        }
+    }
+
+    auto dominant = std::ranges::max_element(bins, {}, &Bin::count);
+    if (dominant->count == 0) return std::unexpected(Error{image.string() + ": fully transparent"});
+    CoverPalette palette{dominant->mean(), dominant->mean()};
+    auto channel = [](uint32_t colour, int shift) { return static_cast<int>((colour >> shift) & 0xFF); };
+    uint64_t best_score = 0;
+    for (const Bin& bin : bins) {
+        if (bin.count == 0) continue;
+        uint32_t colour = bin.mean();
+        int dr = channel(colour, 16) - channel(palette.dominant, 16);
+        int dg = channel(colour, 8) - channel(palette.dominant, 8);
+        int db = channel(colour, 0) - channel(palette.dominant, 0);
+        if (dr * dr + dg * dg + db * db < 64 * 64) continue;
+        int max = std::max({channel(colour, 16), channel(colour, 8), channel(colour, 0)});
+        int min = std::min({channel(colour, 16), channel(colour, 8), channel(colour, 0)});
+        uint64_t score = static_cast<uint64_t>(bin.count) * (16 + max - min);
+        if (score > best_score) {
+            best_score = score;
+            palette.accent = colour;
+        }
+    }
+    return palette;
+}
+
+// Advance widths of the bar font, so frames can be fitted to a pixel budget
+// rather than a codepoint count. Widths are looked up once per codepoint and
+// cached: ASCII in a flat table, everything else in a map. Layouts are also
+// built on prefetch threads, so lookups are serialized.
+class FontMetrics : UniqueOnly {
+public:
+    static Result<std::unique_ptr<FontMetrics>> load (const std::string& path, guint size_px) {
+        auto metrics = std::unique_ptr<FontMetrics>{new FontMetrics{}};
+        if (FT_Init_FreeType(&metrics->library) != 0) {
+            metrics->library = nullptr;
+            return std::unexpected(Error{"FT_Init_FreeType failed"});
+        }
+        if (FT_New_Face(metrics->library, path.c_str(), 0, &metrics->face) != 0) {
+            metrics->face = nullptr;
+            return std::unexpected(Error{"cannot load font " + path});
+        }
+        if (FT_Set_Pixel_Sizes(metrics->face, 0, size_px) != 0) {
+            return std::unexpected(Error{"cannot set font size " + std::to_string(size_px)});
+        }
+        metrics->ascii_advances.fill(unknown_advance);
+        for (auto& padding : metrics->paddings) {
+            padding.advance = metrics->advance(padding.codepoint);
+        }
+        std::ranges::sort(metrics->paddings, std::greater{}, &Padding::advance);
+        return metrics;
+    }
+
+    ~FontMetrics () {
+        if (face != nullptr) FT_Done_Face(face);
+        if (library != nullptr) FT_Done_FreeType(library);
+    }
+
+    uint32_t advance (char32_t codepoint) {
+        std::lock_guard lock{mutex};
+        return advance_locked(codepoint);
+    }
+
+    uint32_t width (std::string_view text) {
+        std::lock_guard lock{mutex};
+        uint32_t total = 0;
+        for (const char* p = text.data(); p < text.data() + text.size();) {
+            total += advance_locked(utf8_decode(p));
+        }
+        return total;
+    }
+
+    // Fills `px` as closely as the font allows with (figure, thin, hair) spaces.
+    void append_padding (std::string& out, uint32_t px) const {
+        for (const auto& padding : paddings) {
+            if (padding.advance == 0) continue;
+            for (; px >= padding.advance; px -= padding.advance) {
+                out.append(padding.utf8);
+            }
+        }
+    }
+
+private:
+    FontMetrics () = default;
+
+    uint32_t advance_locked (char32_t codepoint) {
+        if (codepoint < ascii_advances.size() && ascii_advances[codepoint] != unknown_advance) {
+            return ascii_advances[codepoint];
+        }
+        if (codepoint >= ascii_advances.size()) {
+            auto entry = advances.find(codepoint);
+            if (entry != advances.end()) return entry->second;
+        }
+        uint16_t value = 0;
+        if (FT_Load_Char(face, codepoint, FT_LOAD_DEFAULT) == 0) {
+            value = static_cast<uint16_t>((face->glyph->advance.x + 32) >> 6);
+        }
+        if (codepoint < ascii_advances.size()) {
+            ascii_advances[codepoint] = value;
+        } else {
+            advances.emplace(codepoint, value);
+        }
+        return value;
+    }
+
+    static constexpr uint16_t unknown_advance = std::numeric_limits<uint16_t>::max();
+
+    struct Padding {
+        char32_t codepoint;
+        std::string_view utf8;
+        uint32_t advance = 0;
+    };
+
+    std::mutex mutex;
+    FT_Library library = nullptr;
+    FT_Face face = nullptr;
+    std::array<uint16_t, 128> ascii_advances;
+    std::unordered_map<char32_t, uint16_t> advances;
+    std::array<Padding, 3> paddings{{
+        {U'\u2007', "\u2007"},
+        {U'\u2009', "\u2009"},
+        {U'\u200A', "\u200A"},
+    }};
+};
+
+// Runs the Unicode bidi algorithm over `text` and returns it in visual (left to
+// right display) order, or nothing when it has no right-to-left runs.
+struct VisualText {
+    std::string text;
+    // The paragraph reads right to left, its start is at the visual right.
+    bool rtl = false;
+};
+
+static std::optional<VisualText> visual_order (std::string_view text) {
+    auto bytes = reinterpret_cast<const unsigned char*>(text.data());
+    if (ascii_prefix_length(bytes, text.size()) == text.size()) return std::nullopt;
+
+    std::vector<FriBidiChar> logical(text.size());
+    FriBidiStrIndex length = fribidi_charset_to_unicode(FRIBIDI_CHAR_SET_UTF8, text.data(), static_cast<FriBidiStrIndex>(text.size()), logical.data());
+    std::vector<FriBidiChar> visual(length);
+    FriBidiParType direction = FRIBIDI_PAR_ON;
+    // Returns the highest embedding level plus one, 0 on failure.
+    FriBidiLevel levels = fribidi_log2vis(logical.data(), length, &direction, visual.data(), nullptr, nullptr, nullptr);
+    if (levels <= 1) return std::nullopt;
+
+    VisualText result{std::string(4 * static_cast<size_t>(length) + 1, '\0'), FRIBIDI_IS_RTL(direction) != 0};
+    result.text.resize(fribidi_unicode_to_charset(FRIBIDI_CHAR_SET_UTF8, visual.data(), length, result.text.data()));
+    return result;
+}
+
+// Frame layout of the displayed fields, joined by " ~ ". Every field has its own
+// width budget: fields that fit are encoded once when the layout is built, only
+// overflowing ones scroll, each inside its own budget, and only those are
+// re-sliced per tick. Widths are codepoints, or pixels when `metrics` is set; in
+// the latter case scrolling windows are padded to their exact budget so the
+// module's width stays constant and the bar is not relaid out on every frame.
+// Scrolling fields with right-to-left text are reordered once per track and
+// windows are cut from the visual order, wrapped in a left-to-right override so
+// Pango shows each slice as is instead of reshuffling a truncated paragraph.
+// Right-to-left paragraphs open on their visual right end and scroll rightwards,
+// so they are read in their own direction.
+struct ScrollLayout {
+    static constexpr std::string_view separator = " ~ ";
+    // Shown between the end of a scrolling field and its wrapped around start.
+    static constexpr std::string_view gap = "   ";
+    static constexpr std::string_view ltr_override = "\u202D";
+    static constexpr std::string_view pop_override = "\u202C";
+
+    struct Segment {
+        // Encoded when static. When scrolling, the raw field twice with the gap in
+        // between, so every window is one contiguous slice.
+        std::string text;
+        bool scrolling = false;
+        // `text` is in visual order and is shown inside a left-to-right override.
+        bool visual = false;
+        // The window starts at `first` and moves left one codepoint per step.
+        bool reverse = false;
+        size_t first = 0;
+        size_t cycle = 0;
+        size_t budget = 0;
+        // Byte offset of every codepoint in `text` (plus the end), so slicing is O(1).
+        std::vector<uint32_t> codepoint_offsets;
+        // Cumulative pixel width at every codepoint, metrics mode only.
+        std::vector<uint32_t> width_offsets;
+    };
+
+    std::vector<Segment> segments;
+    bool scrolling = false;
+    FontMetrics* metrics = nullptr;
+
+    size_t width_of (std::string_view text) const {
+        return metrics != nullptr ? metrics->width(text) : utf8_length(text);
+    }
+
+    bool empty () const { return segments.empty(); }
+
+    void build (const std::vector<std::string_view>& fields, size_t max_width) {
+        segments.clear();
+        scrolling = false;
+        std::vector<std::string_view> present;
+        std::vector<size_t> lengths;
+        for (auto field : fields) {
+            if (field.empty()) continue;
+            present.push_back(field);
+            lengths.push_back(width_of(field));
+        }
+        if (present.empty()) return;
+
+        size_t separators_width = width_of(separator) * (present.size() - 1);
+        size_t available = max_width > separators_width + present.size() ? max_width - separators_width : present.size();
+        std::vector<size_t> budgets = distribute_width(lengths, available);
+
+        for (size_t i = 0; i < present.size(); i++) {
+            if (i > 0) append_static(separator);
+            if (lengths[i] <= budgets[i]) {
+                append_static(present[i]);
+                continue;
+            }
+            Segment& segment = segments.emplace_back();
+            segment.scrolling = true;
+            std::optional<VisualText> visual = visual_order(present[i]);
+            std::string_view field = visual ? std::string_view{visual->text} : present[i];
+            segment.visual = visual.has_value();
+            segment.reverse = visual && visual->rtl;
+            size_t field_codepoints = utf8_length(field);
+            segment.cycle = field_codepoints + gap.size();
+            segment.budget = budgets[i];
+            segment.text.append(field).append(gap).append(field);
+            size_t codepoints = 2 * field_codepoints + gap.size();
+            segment.codepoint_offsets.reserve(codepoints + 1);
+            if (metrics != nullptr) segment.width_offsets.reserve(codepoints + 1);
+            const char* begin = segment.text.data();
+            uint32_t width = 0;
+            for (const char* p = begin; segment.codepoint_offsets.size() < codepoints;) {
+                segment.codepoint_offsets.push_back(static_cast<uint32_t>(p - begin));
+                if (metrics != nullptr) {
+                    segment.width_offsets.push_back(width);
+                    width += metrics->advance(utf8_decode(p));
+                } else {
+                    p = utf8_advance(p, 1);
+                }
+            }
+            segment.codepoint_offsets.push_back(static_cast<uint32_t>(segment.text.size()));
+            if (metrics != nullptr) segment.width_offsets.push_back(width);
+            if (segment.reverse) {
+                // The rightmost window that fits, ending where the field does.
+                if (metrics != nullptr) {
+                    const auto& widths = segment.width_offsets;
+                    uint32_t end = widths[field_codepoints];
+                    uint32_t from = end - std::min(end, static_cast<uint32_t>(segment.budget));
+                    segment.first = std::lower_bound(widths.begin(), widths.begin() + field_codepoints, from) - widths.begin();
+                } else {
+                    segment.first = field_codepoints - std::min(field_codepoints, segment.budget);
+                }
+            }
+            scrolling = true;
+        }
+    }
+
+    // Each scrolling field advances one codepoint per step and wraps on its own cycle.
+    void render (std::string& out, uint64_t step) const {
+        for (const Segment& segment : segments) {
+            if (!segment.scrolling) {
+                out.append(segment.text);
+                continue;
+            }
+            size_t start = step % segment.cycle;
+            if (segment.reverse) start = (segment.first + segment.cycle - start) % segment.cycle;
+            const char* begin = segment.text.data();
+            if (segment.visual) out.append(ltr_override);
+            if (metrics == nullptr) {
+                encode_into(out, {begin + segment.codepoint_offsets[start], begin + segment.codepoint_offsets[start + segment.budget]});
+                if (segment.visual) out.append(pop_override);
+                continue;
+            }
+            // The longest window starting at `start` that fits the budget.
+            const auto& widths = segment.width_offsets;
+            uint32_t limit = widths[start] + static_cast<uint32_t>(segment.budget);
+            size_t end = std::upper_bound(widths.begin() + start, widths.end(), limit) - widths.begin() - 1;
+            encode_into(out, {begin + segment.codepoint_offsets[start], begin + segment.codepoint_offsets[end]});
+            if (segment.visual) out.append(pop_override);
+            metrics->append_padding(out, limit - widths[end]);
+        }
+    }
+
+private:
+    void append_static (std::string_view text) {
+        if (segments.empty() || segments.back().scrolling) segments.emplace_back();
+        encode_into(segments.back().text, text);
+    }
+
+    // Fields shorter than an even share keep their full width, whatever they leave
+    // unused is shared among the longer ones.
+    static std::vector<size_t> distribute_width (const std::vector<size_t>& lengths, size_t available) {
+        std::vector<size_t> budgets(lengths.size(), 0);
+        std::vector<size_t> open(lengths.size());
+        for (size_t i = 0; i < open.size(); i++) open[i] = i;
+        while (!open.empty()) {
+            size_t share = available / open.size();
+            size_t settled = std::erase_if(open, [&](size_t i) {
+                if (lengths[i] > share) return false;
+                budgets[i] = lengths[i];
+                available -= lengths[i];
+                return true;
+            });
+            if (settled != 0) continue;
+            for (size_t k = 0; k < open.size(); k++) {
+                budgets[open[k]] = share + (k < available % open.size() ? 1 : 0);
+            }
+            break;
+        }
+        return budgets;
+    }
+};
+
+// Everything shown for one track. Immutable once built, so the screen and the
+// track cache share it.
+struct RenderedTrack {
+    // What it was rendered from; an entry only counts as a hit if these still match.
+    std::string title;
+    std::string artist;
+    std::string album;
+    std::string url;
+    std::vector<std::string> fields;
+    ScrollLayout layout;
+
+    bool matches (const Metadata& metadata) const {
+        return title == metadata.title && artist == metadata.artist
+            && album == metadata.album && url == metadata.url;
+    }
+};
+
+// Builds RenderedTracks. Holds everything it needs by value, so copies can render
+// on worker threads independently of the OutputGenerator.
+struct TrackRenderer {
+    std::shared_ptr<FontMetrics> metrics;
+    size_t max_width = 0;
+    bool show_album = false;
+
+    std::shared_ptr<const RenderedTrack> render (RenderedTrack&& rendered) const {
+        rendered.layout.metrics = metrics.get();
+        rendered.layout.build({rendered.fields.begin(), rendered.fields.end()}, max_width);
+        return std::make_shared<const RenderedTrack>(std::move(rendered));
+    }
+
+    std::shared_ptr<const RenderedTrack> render (const Metadata& metadata) const {
+        RenderedTrack rendered{metadata.title, metadata.artist, metadata.album, metadata.url};
+        const std::string& artist = metadata.artist;
+        rendered.fields.push_back(metadata.title);
+        if (
+            metadata.url.starts_with(std::string_view{"https://www.youtube.com"})
+            && artist.ends_with(std::string_view{" - Topic"})
+        ) {
+            rendered.fields.emplace_back(artist.begin(), artist.end() - 8);
+        } else {
+            rendered.fields.push_back(artist);
+        }
+        if (show_album) rendered.fields.push_back(metadata.album);
+        return render(std::move(rendered));
+    }
+};
+
+// Bounded LRU of rendered tracks keyed by (player, mpris:trackid), so a looping
+// playlist or skipping back and forth re-renders nothing.
+class TrackCache {
+public:
+    struct Key {
+        PlayerUID player;
+        std::string trackid;
+        // Used instead of the track id by players that do not provide a real one.
+        size_t fallback = 0;
+
+        bool operator == (const Key&) const = default;
+
+        struct hash {
+            size_t operator () (const Key& key) const {
+                return PlayerUID::hash{}(key.player) ^ (std::hash<std::string>{}(key.trackid) * 31) ^ key.fallback;
+            }
+        };
+    };
+
+    static Key key_for (const PlayerUID& player, const Metadata& metadata) {
+        if (!metadata.trackid.empty() && metadata.trackid != no_track_id) {
+            return {player, metadata.trackid};
+        }
+        size_t fallback = std::hash<std::string>{}(metadata.title) * 31 + std::hash<std::string>{}(metadata.artist);
+        return {player, {}, fallback};
+    }
+
+    std::shared_ptr<const RenderedTrack> find (const Key& key, const Metadata& metadata) {
+        auto entry = index.find(key);
+        if (entry == index.end() || !entry->second->second->matches(metadata)) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, entry->second);
+        return entry->second->second;
+    }
+
+    bool contains (const Key& key, const Metadata& metadata) const {
+        auto entry = index.find(key);
+        return entry != index.end() && entry->second->second->matches(metadata);
+    }
+
+    void insert (Key key, std::shared_ptr<const RenderedTrack> track) {
+        auto entry = index.find(key);
+        if (entry != index.end()) {
+            entry->second->second = std::move(track);
+            entries.splice(entries.begin(), entries, entry->second);
+            return;
+        }
+        if (entries.size() == capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(key, std::move(track));
+        index.emplace(std::move(key), entries.begin());
+    }
+
+    size_t hits = 0;
+    size_t misses = 0;
+
+private:
+    static constexpr size_t capacity = 64;
+
+    using Entry = std::pair<Key, std::shared_ptr<const RenderedTrack>>;
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, Key::hash> index;
+};
+
+// Distribution summary of some duration, for the SIGUSR1 report.
+struct LatencyStats {
+    size_t count = 0;
+    gint64 total_us = 0;
+    gint64 max_us = 0;
+
+    void record (gint64 us) {
+        count++;
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+
+    void report (std::ostream& out, std::string_view name) const {
+        out << name << ": " << count << " samples";
+        if (count != 0) out << ", avg " << total_us / static_cast<gint64>(count) << " us, max " << max_us << " us";
+        out << "\n";
+    }
+};
+
+template <typename Job>
+struct WorkerTask {
+    Job job;
+    void (*done) (Job& job, gpointer data);
+    gpointer data;
+};
+
+// Runs `job.run(cancellable)` on GLib's worker pool and hands the job to `done`
+// back on the main context, unless `cancellable` fired in the meantime. The job
+// must own everything it touches.
+template <typename Job>
+static void run_in_worker (GCancellable* cancellable, Job&& job, void (*done) (Job&, gpointer), gpointer data) {
+    GHandle<GTask> task{g_task_new(nullptr, cancellable, +[](GObject*, GAsyncResult* result, gpointer) {
+        auto task = reinterpret_cast<GTask*>(result);
+        if (!handle_gfunc(g_task_propagate_boolean, task)) return;
+        auto work = static_cast<WorkerTask<Job>*>(g_task_get_task_data(task));
+        work->done(work->job, work->data);
+    }, nullptr)};
+    g_task_set_task_data(task.get(), new WorkerTask<Job>{std::move(job), done, data}, +[](gpointer work) {
+        delete static_cast<WorkerTask<Job>*>(work);
+    });
+    g_task_run_in_thread(task.get(), +[](GTask* task, gpointer, gpointer work, GCancellable* cancellable) {
+        static_cast<WorkerTask<Job>*>(work)->job.run(cancellable);
+        g_task_return_boolean(task, TRUE);
+    });
+}
+
+struct ThumbnailJob {
+    std::string source;
+    // Otherwise an existing thumbnail or the snapshot is used.
+    bool generate = true;
+    fs::path target;
+    std::optional<Error> error;
+
+    void run (GCancellable*) {
+        auto path = file_uri_path(source);
+        if (!path) {
+            error = path.error();
+            return;
+        }
+        target = *path;
+        struct stat st;
+        if (stat(path->c_str(), &st) != 0) {
+            error = Error{*path + ": " + std::strerror(errno)};
+            return;
+        }
+        auto uri = path_file_uri(*path);
+        if (!uri) {
+            error = uri.error();
+            return;
+        }
+        for (std::string_view size : {"normal", "large"}) {
+            fs::path thumbnail = thumbnail_path(*uri, size);
+            if (thumbnail_is_fresh(thumbnail, *uri, st.st_mtime)) {
+                target = std::move(thumbnail);
+                return;
+            }
+        }
+        // Without a snapshot the player's file is linked as it is, which is not
+        // worth reporting on its own. It is not thumbnailed: the shared cache
+        // would keep whatever it held then under an mtime from before.
+        auto snapshot = snapshot_cover(*path);
+        if (!snapshot) return;
+        target = std::move(snapshot->path);
+        if (!generate) return;
+        // The thumbnail is made from the copy, so it carries the copy's mtime.
+        auto generated = generate_thumbnail(target, *uri, snapshot->source_mtime);
+        if (!generated) {
+            error = generated.error();
+            return;
+        }
+        target = std::move(*generated);
+    }
+};
+
+struct PaletteJob {
+    fs::path image;
+    std::string key;
+    std::optional<CoverPalette> palette;
+    std::optional<Error> error;
+
+    void run (GCancellable*) {
+        auto computed = compute_palette(image);
+        if (computed) {
+            palette = *computed;
+        } else {
+            error = computed.error();
+        }
+    }
+};
+
+struct LyricsJob {
+    std::string source;
+    // Unset when the track has no synced lyrics.
+    std::shared_ptr<const Lyrics> lyrics;
+
+    void run (GCancellable*) {
+        auto path = file_uri_path(source);
+        if (!path) return;
+        auto loaded = load_lyrics(*path);
+        if (loaded) lyrics = std::make_shared<const Lyrics>(std::move(*loaded));
+    }
+};
+
+// Pulls the cover out of a local audio file's tags into the cover store.
+struct EmbeddedCoverJob {
+    std::string source;
+    // Unset when the file simply has no picture.
+    std::optional<fs::path> stored;
+    std::optional<Error> error;
+
+    void run (GCancellable*) {
+        auto path = file_uri_path(source);
+        if (!path) {
+            error = path.error();
+            return;
+        }
+        auto cover = read_embedded_cover(*path);
+        if (!cover) {
+            error = cover.error();
+            return;
+        }
+        if (!*cover) return;
+        auto published = store_cover((*cover)->data());
+        if (!published) {
+            error = published.error();
+            return;
+        }
+        stored = std::move(*published);
+    }
+};
+
+// Where a track's cover comes from: its art URL, or for a local file without
+// one, the file itself, whose tags may hold a picture.
+struct CoverSource {
+    std::string url;
+    bool embedded = false;
+};
+
+static CoverSource cover_source (const Metadata& metadata) {
+    // Local players often leave artUrl empty, the picture is in the file's tags then.
+    if (metadata.art_url.empty() && metadata.url.starts_with("file://")) return {metadata.url, true};
+    return {metadata.art_url, false};
+}
+
+// A cover resolved ahead of its track by the same jobs a track change runs.
+struct PrefetchedCover {
+    std::string source;
+    // Empty when there is nothing to link.
+    fs::path target;
+    std::string palette_key;
+    std::optional<CoverPalette> palette;
+};
+
+// Renders upcoming tracks and resolves their covers, so reaching them later
+// costs a cache lookup and a relink.
+struct PrefetchJob {
+    TrackRenderer renderer;
+    PlayerUID player;
+    std::vector<Metadata> tracks;
+    bool decode_covers = true;
+    bool cover_colors = false;
+    std::vector<std::shared_ptr<const RenderedTrack>> rendered;
+    std::vector<PrefetchedCover> covers;
+
+    void run (GCancellable* cancellable) {
+        for (const Metadata& track : tracks) {
+            if (g_cancellable_is_cancelled(cancellable)) return;
+            rendered.push_back(renderer.render(track));
+            prefetch_cover(cover_source(track), cancellable);
+        }
+    }
+
+    // Failures are left for the track change to run into and report.
+    void prefetch_cover (const CoverSource& source, GCancellable* cancellable) {
+        if (!source.url.starts_with("file://")) return;
+        PrefetchedCover cover{source.url};
+        if (source.embedded) {
+            EmbeddedCoverJob job{source.url};
+            job.run(cancellable);
+            if (job.error) return;
+            if (job.stored) cover.target = std::move(*job.stored);
+        } else {
+            ThumbnailJob job{source.url, decode_covers};
+            job.run(cancellable);
+            if (job.error || job.target.empty()) return;
+            cover.target = std::move(job.target);
+        }
+        if (cover_colors && decode_covers && !cover.target.empty()) {
+            auto key = cover_version_key(cover.target);
+            if (key) {
+                PaletteJob job{cover.target, *key};
+                job.run(cancellable);
+                if (job.palette) {
+                    cover.palette_key = std::move(*key);
+                    cover.palette = job.palette;
+                }
+            }
+        }
+        covers.push_back(std::move(cover));
+    }
+};
+
+struct CoverStoreSweepJob {
+    fs::path keep;
+    std::optional<Error> error;
+
+    void run (GCancellable*) {
+        auto swept = sweep_cover_store(keep);
+        if (!swept) error = swept.error();
+    }
+};
+
+// Listening history, one JSON object per line. It is neither cache nor runtime
+// data, so it lives under $XDG_STATE_HOME, shared by all instances and written
+// by one of them at a time.
+static fs::path history_path () {
+    return fs::path{g_get_user_state_dir()}/"mpris"/"history.jsonl";
+}
+
+// One listened track. Times are wall clock, except `listened_ms` which only
+// counts time spent playing.
+struct HistoryEntry {
+    std::string player;
+    std::string title;
+    std::string artist;
+    std::string album;
+    gint64 started = 0; // Unix time in seconds
+    gint64 length_ms = 0;
+    gint64 listened_ms = 0;
+
+    void write_into (std::string& buffer) const {
+        buffer.append("{\"started\":").append(std::to_string(started));
+        buffer.append(",\"length_ms\":").append(std::to_string(length_ms));
+        buffer.append(",\"listened_ms\":").append(std::to_string(listened_ms));
+        for (auto [key, value] : {
+            std::pair{"player", &player}, {"title", &title}, {"artist", &artist}, {"album", &album}
+        }) {
+            buffer.append(",\"").append(key).append("\":\"");
+            json_escape_into(buffer, *value);
+            buffer.push_back('"');
+        }
+        buffer.append("}\n");
+    }
+};
+
+// Reads back what `HistoryEntry::write_into` produces: one flat object of
+// strings and integers. Unknown keys are skipped.
+static std::optional<HistoryEntry> parse_history_entry (std::string_view line) {
+    size_t pos = 0;
+    auto expect = [&](char c) {
+        while (pos < line.size() && line[pos] == ' ') pos++;
+        if (pos >= line.size() || line[pos] != c) return false;
+        pos++;
+        return true;
+    };
+    auto string = [&]() -> std::optional<std::string> {
+        if (!expect('"')) return std::nullopt;
+        std::string value;
+        while (pos < line.size()) {
+            char c = line[pos++];
+            if (c == '"') return value;
+            if (c != '\\') {
+                value.push_back(c);
+                continue;
+            }
+            if (pos >= line.size()) break;
+            char escaped = line[pos++];
+            if (escaped == 'u') {
+                guint32 codepoint = 0;
+                auto [end, ec] = std::from_chars(line.data() + pos, line.data() + std::min(pos + 4, line.size()), codepoint, 16);
+                if (ec != std::errc{} || end != line.data() + pos + 4) return std::nullopt;
+                pos += 4;
+                std::array<gchar, 6> utf8;
+                value.append(utf8.data(), g_unichar_to_utf8(codepoint, utf8.data()));
+            } else if (escaped == 'n') {
+                value.push_back('\n');
+            } else if (escaped == 't') {
+                value.push_back('\t');
+            } else {
+                value.push_back(escaped);
+            }
+        }
+        return std::nullopt;
+    };
+    auto number = [&]() -> std::optional<gint64> {
+        gint64 value = 0;
+        auto [end, ec] = std::from_chars(line.data() + pos, line.data() + line.size(), value);
+        if (ec != std::errc{}) return std::nullopt;
+        pos = end - line.data();
+        return value;
+    };
+
+    HistoryEntry entry;
+    if (!expect('{')) return std::nullopt;
+    if (expect('}')) return entry;
+    do {
+        auto key = string();
+        if (!key || !expect(':')) return std::nullopt;
+        while (pos < line.size() && line[pos] == ' ') pos++;
+        if (pos < line.size() && line[pos] == '"') {
+            auto value = string();
+            if (!value) return std::nullopt;
+            if (*key == "player") entry.player = std::move(*value);
+            else if (*key == "title") entry.title = std::move(*value);
+            else if (*key == "artist") entry.artist = std::move(*value);
+            else if (*key == "album") entry.album = std::move(*value);
+        } else {
+            auto value = number();
+            if (!value) return std::nullopt;
+            if (*key == "started") entry.started = *value;
+            else if (*key == "length_ms") entry.length_ms = *value;
+            else if (*key == "listened_ms") entry.listened_ms = *value;
+        }
+    } while (expect(','));
+    if (!expect('}')) return std::nullopt;
+    return entry;
+}
+
+// Appends `batch` with one write and syncs it. Once the log would outgrow
+// `max_size` it is moved aside to `.1`, replacing the previous one, and a new
+// log is started. Writers hold an exclusive lock on the log from the size check
+// to the write; one that waited on a log moved aside meanwhile finds it no
+// longer at `path` and reopens.
+static Result<void> append_history (const fs::path& path, std::string_view batch, off_t max_size) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    if (ec) return std::unexpected(Error{path.parent_path().string() + ": " + ec.message()});
+    auto failed = [&](const fs::path& file, int fd) {
+        int saved_errno = errno;
+        if (fd >= 0) close(fd);
+        return std::unexpected(Error{file.string() + ": " + std::strerror(saved_errno)});
+    };
+    fs::path rotated = path;
+    rotated += ".1";
+    while (true) {
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) return failed(path, fd);
+        int locked;
+        do {
+            locked = flock(fd, LOCK_EX);
+        } while (locked != 0 && errno == EINTR);
+        if (locked != 0) return failed(path, fd);
+        struct stat st;
+        struct stat current;
+        if (fstat(fd, &st) != 0) return failed(path, fd);
+        if (stat(path.c_str(), &current) != 0 || current.st_dev != st.st_dev || current.st_ino != st.st_ino) {
+            close(fd);
+            continue;
+        }
+        if (st.st_size > 0 && st.st_size + static_cast<off_t>(batch.size()) > max_size) {
+            if (rename(path.c_str(), rotated.c_str()) != 0) return failed(rotated, fd);
+            // Wakes up writers waiting on the old log.
+            close(fd);
+            continue;
+        }
+        auto written = write_all(fd, batch);
+        if (written && fdatasync(fd) != 0) {
+            written = std::unexpected(Error{std::strerror(errno)});
+        }
+        close(fd);
+        if (!written) return std::unexpected(Error{path.string() + ": " + written.error().message});
+        return {};
+    }
+}
+
+// A flush in flight, shared with the worker so shutdown can wait for it without
+// running the main loop.
+struct HistoryFlush {
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool finished = false;
+    std::optional<Error> error;
+    // The batch, handed back when it could not be written.
+    std::string failed;
+};
+
+struct HistoryFlushJob {
+    std::string batch;
+    std::shared_ptr<HistoryFlush> flush;
+
+    void run (GCancellable*) {
+        auto appended = append_history(history_path(), batch, HistoryFlushJob::max_size);
+        std::lock_guard lock{flush->mutex};
+        if (!appended) {
+            flush->error = appended.error();
+            flush->failed = std::move(batch);
+        }
+        flush->finished = true;
+        flush->finished_cv.notify_all();
+    }
+
+    static constexpr off_t max_size = 8 << 20;
+};
+
+// Entries are batched in memory and appended by the worker at most once per
+// flush interval, so logging a track never touches the disk on the event path.
+class HistoryLog : UniqueOnly {
+public:
+    static constexpr guint flush_interval_ms = 5 * 60 * 1000;
+    // Entries kept while the log cannot be written, beyond that the oldest go.
+    static constexpr size_t max_pending = 1 << 20;
+
+    ~HistoryLog () {
+        if (writer_lock >= 0) close(writer_lock);
+    }
+
+    // Every instance sees the same players, so only the one holding the writer
+    // lock logs; another takes over once it exits. The lock file is opened here,
+    // at startup, checking it later is a flock on the open fd.
+    void open_writer_lock () {
+        fs::path path = history_path();
+        path += ".lock";
+        std::error_code ec;
+        fs::create_directories(path.parent_path(), ec);
+        writer_lock = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (writer_lock < 0) {
+            errors.report("Error opening listening history lock", Error{path.string() + ": " + std::strerror(errno)});
+        }
+    }
+
+    // Without a lock file every instance logs, duplicates beat gaps.
+    bool is_writer () {
+        if (!writer && writer_lock >= 0) writer = flock(writer_lock, LOCK_EX | LOCK_NB) == 0;
+        return writer || writer_lock < 0;
+    }
+
+    void append (const HistoryEntry& entry) {
+        entry.write_into(pending);
+        if (pending.size() > max_pending) {
+            size_t cut = pending.find('\n', pending.size() - max_pending);
+            pending.erase(0, cut == std::string::npos ? pending.size() : cut + 1);
+        }
+        schedule_flush();
+    }
+
+    // For shutdown and hot upgrades, when the main loop will not run again: waits
+    // for a flush in flight and writes the rest on the calling thread.
+    void flush_now () {
+        timer_wheel.cancel(flush_timer);
+        flush_timer = 0;
+        if (in_flight) {
+            std::shared_ptr<HistoryFlush> flush = std::move(in_flight);
+            std::unique_lock lock{flush->mutex};
+            flush->finished_cv.wait(lock, [&] { return flush->finished; });
+            take_back(*flush);
+        }
+        if (pending.empty()) return;
+        auto appended = append_history(history_path(), pending, HistoryFlushJob::max_size);
+        if (!appended) errors.report("Error writing listening history", appended.error());
+        pending.clear();
+    }
+
+private:
+    std::string pending;
+    int writer_lock = -1;
+    bool writer = false;
+    std::shared_ptr<HistoryFlush> in_flight;
+    TimerWheel::Id flush_timer = 0;
+    ErrorLog errors;
+
+    void schedule_flush () {
+        if (flush_timer != 0 || in_flight || pending.empty()) return;
+        flush_timer = timer_wheel.schedule(flush_interval_ms, flush_interval_ms / 10, [this] {
+            flush_timer = 0;
+            in_flight = std::make_shared<HistoryFlush>();
+            run_in_worker(nullptr, HistoryFlushJob{std::exchange(pending, {}), in_flight}, on_flushed, this);
+        });
+    }
+
+    static void on_flushed (HistoryFlushJob& job, gpointer data) {
+        auto self = static_cast<HistoryLog*>(data);
+        // Already taken back by flush_now.
+        if (job.flush != self->in_flight) return;
+        self->in_flight.reset();
+        self->take_back(*job.flush);
+        self->schedule_flush();
+    }
+
+    // A batch that could not be written is retried with the next one.
+    void take_back (HistoryFlush& flush) {
+        if (!flush.error) return;
+        errors.report("Error writing listening history", *flush.error);
+        flush.failed.append(pending);
+        pending = std::move(flush.failed);
+    }
+};
+
+struct OutputGenerator : ManagedPlayerHandler, SessionActivityMonitor::Handler, PowerSourceMonitor::Handler, TrackListPrefetcher::Handler {
+    OutputGenerator()
+    :
+    renderer(make_renderer()),
+    restored(restore_snapshot()),
+    manager(this),
+    session_monitor(this),
+    power_monitor(this),
+    prefetcher(this),
+    worker_cancellable(g_cancellable_new())
+    {
+        if (config.cover_in_output) adopt_cover_versions();
+        if (config.history) history.open_writer_lock();
+        // The restored frame is stale if no player survived the restart.
+        if (restored && manager.selected_player() == nullptr) {
+            on_empty();
+        }
+        update_scrolling();
+    }
+
+    ~OutputGenerator () {
+        g_cancellable_cancel(worker_cancellable.get());
+    }
+
+    TrackRenderer renderer;
+    std::shared_ptr<const RenderedTrack> track = std::make_shared<RenderedTrack>();
+    TrackCache track_cache;
+    // Time from a track change arriving to its frame being written, split by
+    // whether the track was already rendered.
+    LatencyStats track_change_hits;
+    LatencyStats track_change_misses;
+    std::string frame;
+    // The scroll position is a pure function of CLOCK_MONOTONIC and this epoch,
+    // aligned to the scroll interval. The epoch is derived from when the track
+    // started by the player's position, not from when the change arrived, so
+    // instances per monitor, including ones started mid-track, render identical
+    // frames in phase, and a late tick skips ahead instead of shifting the phase.
+    gint64 scroll_epoch_us = 0;
+    // The start the epoch was derived from, kept to re-derive it for another interval.
+    gint64 scroll_anchor_us = 0;
+    // When the current track would have started playing from 0, moved by seeks.
+    gint64 track_start_us = 0;
+    uint64_t scroll_step = 0;
+    const RenderProfile* profile = &config.ac_profile;
+
+    bool is_playing = false;
+
+    struct LastSource {
+        PlayerUID player;
+        std::string title;
+        std::string artist;
+        std::string album;
         std::string art_url;
     };
     LastSource last_src;
-    
+
+    TimerWheel::Id snapshot_timer = 0;
+    bool restored = false;
+    ErrorLog cover_errors;
+
+    // Output mode cover versions: the one in the stream, and replaced ones that
+    // are kept until a consumer has surely moved on.
+    std::string cover_version;
+    std::vector<std::pair<fs::path, gint64>> retired_covers;
+    TimerWheel::Id cover_gc_timer = 0;
+    TimerWheel::Id cover_sweep_timer = 0;
+    // Waybar's pid once looked up, -1 if we do not run under waybar.
+    pid_t waybar_pid = 0;
+
+    // Palettes by cover version, each is computed once. The markup and JSON
+    // pieces for the current one are prepared when it changes, not per frame.
+    std::unordered_map<std::string, CoverPalette> palettes;
+    // Covers of upcoming tracks by source, resolved by the prefetcher. Each is
+    // used once, by the track change that needs it.
+    std::unordered_map<std::string, fs::path> prefetched_covers;
+    std::string palette_key;
+    std::string palette_open;
+    std::string palette_close;
+    std::string palette_classes;
+
+    // Lyrics of the current track and the line on screen. The line only changes
+    // on a timer armed for the next line's start, from a position anchored at the
+    // last state change or seek; nothing polls the player.
+    std::string lyrics_source;
+    std::shared_ptr<const Lyrics> lyrics;
+    size_t lyric_line = Lyrics::none;
+    ScrollLayout lyric_layout;
+    gint64 position_anchor_us = 0;
+    gint64 position_anchor_time = 0;
+    TimerWheel::Id lyric_timer = 0;
+
+    // The track being listened to, logged once it ends. Playing time is summed
+    // up between state changes.
+    std::optional<HistoryEntry> listening;
+    gint64 listening_since = 0;
+    HistoryLog history;
+
     PlayerManager manager;
 
+    // Nobody can see the bar while the session is idle or locked, so neither
+    // scroll ticks nor frames are produced then.
+    SessionActivityMonitor session_monitor;
+    bool suspended = false;
+    TimerWheel::Id scroll_timer = 0;
+
+    PowerSourceMonitor power_monitor;
+
+    TrackListPrefetcher prefetcher;
+    GHandle<GCancellable> worker_cancellable;
+
     static constexpr size_t max_width = 50;
+    static constexpr guint snapshot_debounce_ms = 1000;
+    static constexpr guint scroll_tolerance_ms = 10;
+    static constexpr guint cover_grace_ms = 10000;
+    static constexpr guint cover_sweep_delay_ms = 10 * 60 * 1000;
+    static constexpr size_t max_palettes = 256;
+    static constexpr size_t max_prefetched_covers = 64;
+    static constexpr guint lyric_tolerance_ms = 10;
+
+    // Shows the previous instance's last frame and adopts its state, so live data
+    // that matches it is neither re-rendered nor re-linked.
+    bool restore_snapshot () {
+        std::optional<Snapshot> snapshot;
+        if (const char* state_fd = std::getenv(state_fd_env)) {
+            int fd = std::atoi(state_fd);
+            snapshot = Snapshot::load(fd);
+            close(fd);
+            unsetenv(state_fd_env);
+        } else {
+            snapshot = Snapshot::load(snapshot_path());
+        }
+        if (!snapshot) return false;
+        last_src.player = std::move(snapshot->player);
+        last_src.title = std::move(snapshot->title);
+        last_src.artist = std::move(snapshot->artist);
+        last_src.album = std::move(snapshot->album);
+        last_src.art_url = std::move(snapshot->art_url);
+        track = renderer.render(RenderedTrack{.fields = std::move(snapshot->fields)});
+        // Monotonic time restarts at boot, an epoch from the future is from before it.
+        scroll_epoch_us = std::min<gint64>(snapshot->scroll_epoch_us, g_get_monotonic_time());
+        // The epoch is the first boundary after its anchor, so this re-derives it.
+        scroll_anchor_us = scroll_epoch_us - 1;
+        track_start_us = scroll_anchor_us;
+        scroll_step = scroll_step_at(g_get_monotonic_time());
+        is_playing = snapshot->is_playing;
+        frame = std::move(snapshot->frame);
+        std::cout.write(frame.data(), frame.size());
+        std::cout.flush();
+        return true;
+    }
+
+    const PlayerUID* preferred_player () const override {
+        return restored ? &last_src.player : nullptr;
+    }
+
+    void schedule_snapshot () {
+        if (snapshot_timer != 0) return;
+        snapshot_timer = timer_wheel.schedule(snapshot_debounce_ms, snapshot_debounce_ms / 2, [this] {
+            snapshot_timer = 0;
+            save_snapshot();
+        });
+    }
+
+    Snapshot make_snapshot () const {
+        return {
+            last_src.player,
+            is_playing,
+            scroll_epoch_us,
+            last_src.title,
+            last_src.artist,
+            last_src.album,
+            last_src.art_url,
+            track->fields,
+            frame
+        };
+    }
+
+    void save_snapshot () const {
+        if (!make_snapshot().save(snapshot_path())) {
+            std::cerr << "Failed to save state snapshot\n";
+        }
+    }
+
+    // Re-executes the (possibly replaced) binary with the current state in a memfd.
+    // stdout is inherited as is and the cover file is left in place, so the bar
+    // keeps its content and scroll position. D-Bus connections cannot survive exec,
+    // the new image reconnects and reconciles against the handed over state.
+    void hot_upgrade () {
+        // A termination signal dispatched in the same iteration wins.
+        if (terminating) return;
+        int fd = make_snapshot().to_memfd();
+        if (fd < 0) {
+            std::cerr << "Hot upgrade failed: could not serialize state\n";
+            return;
+        }
+        // exec drops everything in memory: the listen so far is logged and written
+        // first, the new image starts another entry for the rest of the track.
+        if (config.history) {
+            finish_listening();
+            history.flush_now();
+        }
+        std::cout.flush();
+        setenv(state_fd_env, std::to_string(fd).c_str(), 1);
+        block_main_loop_signals(true);
+        execv(self_exe.c_str(), self_argv);
+        block_main_loop_signals(false);
+        std::cerr << "Hot upgrade failed: " << std::strerror(errno) << "\n";
+        unsetenv(state_fd_env);
+        close(fd);
+    }
 
     void on_select (const Player& player) override {
         // display_print("Select recieved");
@@ -644,8 +3914,16 @@ struct OutputGenerator : ManagedPlayerHandler {
 
     void on_empty () override {
         // display_print("Empty recieved");
-        display_print("");
-        needs_scrolling = false;
+        track = renderer.render(RenderedTrack{});
+        update_scrolling();
+        display();
+        last_src.player = {};
+        last_src.title.clear();
+        last_src.artist.clear();
+        last_src.album.clear();
+        if (config.lyrics) reset_lyrics();
+        if (config.history) finish_listening();
+        schedule_snapshot();
     }
 
     void on_state (const Player& player) override {
@@ -658,90 +3936,489 @@ struct OutputGenerator : ManagedPlayerHandler {
         auto& state = player.state;
         auto& title = state.metadata.title;
         auto& artist = state.metadata.artist;
-        auto& art_url = state.metadata.art_url;
+        auto& album = state.metadata.album;
         bool new_is_playing = state.playback_status == PLAYERCTL_PLAYBACK_STATUS_PLAYING;
-        if (last_src.title == title && last_src.artist == artist) {
+        last_src.player = player.uid;
+        bool track_changed = last_src.title != title || last_src.artist != artist || last_src.album != album;
+        if (!track_changed) {
             if (is_playing != new_is_playing) {
                 is_playing = new_is_playing;
                 display();
             }
         } else {
-            display_offset = 0;
+            gint64 started = g_get_monotonic_time();
+            track_start_us = started - track_position(player);
+            anchor_scroll_epoch(track_start_us);
             last_src.title = title;
             last_src.artist = artist;
-            if (
-                state.metadata.url.starts_with(std::string_view{"https://www.youtube.com"})
-                && artist.ends_with(std::string_view{" - Topic"})
-            ) {
-                update_to_display(title, std::string_view{artist.begin(), artist.end() - 8});
-            } else {
-                update_to_display(title, artist);
+            last_src.album = album;
+            auto key = TrackCache::key_for(player.uid, state.metadata);
+            track = track_cache.find(key, state.metadata);
+            LatencyStats& latency = track ? track_change_hits : track_change_misses;
+            if (!track) {
+                track = renderer.render(state.metadata);
+                track_cache.insert(std::move(key), track);
             }
             is_playing = new_is_playing;
+            update_scrolling();
             display();
+            latency.record(g_get_monotonic_time() - started);
+            if (config.prefetch) prefetcher.prefetch(player.uid, state.metadata.trackid);
         }
-        if (to_display.empty()) {
+        if (track->layout.empty()) {
             clear_cover_art();
         } else {
-            update_cover_art(art_url);
+            update_cover_art(state.metadata);
+        }
+        if (config.lyrics) sync_lyrics(player);
+        if (config.history) update_listening(player, track_changed);
+        schedule_snapshot();
+    }
+
+    void update_listening (const Player& player, bool track_changed) {
+        gint64 now = g_get_monotonic_time();
+        if (listening && listening_since != 0) {
+            listening->listened_ms += (now - listening_since) / 1000;
+        }
+        listening_since = 0;
+        if (track_changed || !listening) {
+            finish_listening();
+            if (track->layout.empty()) return;
+            const Metadata& metadata = player.state.metadata;
+            listening = HistoryEntry{
+                player.uid.name, metadata.title, metadata.artist, metadata.album,
+                g_get_real_time() / G_USEC_PER_SEC, static_cast<gint64>(metadata.length / 1000)
+            };
+        }
+        if (is_playing) listening_since = now;
+    }
+
+    // Tracks that never played, e.g. skipped while paused, are not logged.
+    void finish_listening () {
+        if (!listening) return;
+        if (listening_since != 0) {
+            listening->listened_ms += (g_get_monotonic_time() - listening_since) / 1000;
+            listening_since = 0;
+        }
+        if (listening->listened_ms > 0 && history.is_writer()) history.append(*listening);
+        listening.reset();
+    }
+
+    void on_seeked (const Player& player) override {
+        if (!config.lyrics || !player.is_selected) return;
+        sync_lyrics(player, static_cast<gint64>(player.state.seeked_to));
+    }
+
+    // Loads lyrics on a track change and re-anchors the position: on the one a
+    // Seeked signal carried, or else on playerctl's cached one. Playerctl may not
+    // have seen the seek yet when we do.
+    void sync_lyrics (const Player& player, std::optional<gint64> seeked_to = std::nullopt) {
+        const std::string& url = player.state.metadata.url;
+        if (url != lyrics_source) {
+            reset_lyrics();
+            lyrics_source = url;
+            if (url.starts_with("file://")) {
+                run_in_worker(worker_cancellable.get(), LyricsJob{url}, on_lyrics, this);
+            }
+        }
+        position_anchor_us = seeked_to ? *seeked_to : track_position(player);
+        position_anchor_time = g_get_monotonic_time();
+        if (seeked_to) track_start_us = position_anchor_time - position_anchor_us;
+        update_lyric_line();
+    }
+
+    static void on_lyrics (LyricsJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        if (self->lyrics_source != job.source) return;
+        self->lyrics = std::move(job.lyrics);
+        self->update_lyric_line();
+    }
+
+    void reset_lyrics () {
+        timer_wheel.cancel(lyric_timer);
+        lyric_timer = 0;
+        lyrics_source.clear();
+        lyrics.reset();
+        show_lyric_line(Lyrics::none);
+    }
+
+    // Playback rate is taken as 1, the anchor is renewed on every state change.
+    gint64 track_position_at (gint64 now) const {
+        return position_anchor_us + (is_playing ? now - position_anchor_time : 0);
+    }
+
+    void update_lyric_line () {
+        timer_wheel.cancel(lyric_timer);
+        lyric_timer = 0;
+        if (!lyrics) {
+            return show_lyric_line(Lyrics::none);
+        }
+        gint64 position = track_position_at(g_get_monotonic_time());
+        size_t line = lyrics->line_at(position);
+        size_t next = line == Lyrics::none ? 0 : line + 1;
+        // Nobody sees the line while suspended, the resume catches up.
+        if (is_playing && !suspended && next < lyrics->lines.size()) {
+            gint64 wait_ms = (lyrics->lines[next].start_us - position) / 1000 + 1;
+            lyric_timer = timer_wheel.schedule(static_cast<guint>(wait_ms), lyric_tolerance_ms, [this] {
+                lyric_timer = 0;
+                update_lyric_line();
+            });
+        }
+        show_lyric_line(line);
+    }
+
+    // Lines without text, e.g. instrumental breaks, show the track again.
+    void show_lyric_line (size_t line) {
+        if (line == lyric_line) return;
+        lyric_line = line;
+        std::string_view text = line == Lyrics::none ? std::string_view{} : lyrics->lines[line].text;
+        lyric_layout.metrics = renderer.metrics.get();
+        lyric_layout.build({text}, renderer.max_width);
+        // Anchored on when the line starts in the track, like the track on when
+        // it started, so every instance scrolls it in phase.
+        anchor_scroll_epoch(line == Lyrics::none ? track_start_us : track_start_us + lyrics->lines[line].start_us);
+        update_scrolling();
+        display();
+    }
+
+    const ScrollLayout& shown_layout () const {
+        return lyric_layout.empty() ? track->layout : lyric_layout;
+    }
+
+    // Runs once the main loop has stopped: persists the final state, or removes the
+    // runtime files of a per-process instance, drops the cover and pushes out
+    // anything still buffered. Players are released afterwards, in bulk,
+    // by ~PlayerManager.
+    void shutdown () {
+        timer_wheel.cancel(snapshot_timer);
+        snapshot_timer = 0;
+        clear_cover_art();
+        timer_wheel.cancel(cover_gc_timer);
+        cover_gc_timer = 0;
+        timer_wheel.cancel(cover_sweep_timer);
+        cover_sweep_timer = 0;
+        timer_wheel.cancel(lyric_timer);
+        lyric_timer = 0;
+        if (config.history) {
+            finish_listening();
+            history.flush_now();
+        }
+        if (config.instance_per_process) {
+            std::error_code ec;
+            fs::remove_all(instance_dir(), ec);
+        } else {
+            save_snapshot();
         }
+        std::cout.flush();
     }
 
-    void remove_cover_art_file () noexcept(false) {
-        if (fs::symlink_status(cache_path).type() == fs::file_type::not_found) return;
-        fs::remove(cache_path);
+    Result<void> remove_cover_art_file () {
+        std::error_code ec;
+        fs::remove(cover_link_path(), ec);
+        return check_error_code(ec);
     }
 
     void clear_cover_art () {
         if (last_src.art_url.empty()) return;
         last_src.art_url.clear();
-        try {
-            remove_cover_art_file();
-        } catch (const std::exception& e) {
-            std::cerr << "Error updating clearing art: " << e.what() << "\n";
+        unlink_cover_art();
+    }
+
+    // Takes the cover off the bar but keeps its source, so it is not retried.
+    void unlink_cover_art () {
+        auto removed = remove_cover_art_file();
+        if (!removed) {
+            cover_errors.report("Error clearing cover art", removed.error());
         }
-        refresh_waybar_image();
+        if (config.cover_colors && !palette_key.empty()) set_palette({}, std::nullopt);
+        if (!config.cover_in_output) {
+            return refresh_waybar_image();
+        }
+        retire_cover_version();
+        display();
     }
 
-    void update_cover_art (const std::string& art_url) {
-        if (art_url == last_src.art_url) return;
-        if (!art_url.starts_with("file://")) {
+    // `last_src.art_url` names where the cover came from: the art URL, or for
+    // covers embedded in a local file, the file's URL.
+    void update_cover_art (const Metadata& metadata) {
+        auto [source, embedded] = cover_source(metadata);
+        if (source == last_src.art_url) return;
+        if (!source.starts_with("file://")) {
             return clear_cover_art();
         }
-        last_src.art_url = art_url;
-        try {
-            remove_cover_art_file();
-            fs::create_symlink(art_url.substr(7), cache_path);
-        } catch (const std::exception& e) {
-            std::cerr << "Error updating cover art: " << e.what() << "\n";
+        last_src.art_url = source;
+        auto prefetched = prefetched_covers.find(source);
+        if (prefetched != prefetched_covers.end()) {
+            fs::path target = std::move(prefetched->second);
+            prefetched_covers.erase(prefetched);
+            if (target.empty()) return unlink_cover_art();
+            return link_cover_art(target);
+        }
+        if (embedded) {
+            // The previous cover stays up until extraction finishes.
+            return run_in_worker(worker_cancellable.get(), EmbeddedCoverJob{source}, on_embedded_cover, this);
+        }
+        run_in_worker(worker_cancellable.get(), ThumbnailJob{source, profile->decode_covers}, on_thumbnail, this);
+    }
+
+    static void on_thumbnail (ThumbnailJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        if (self->last_src.art_url != job.source) return;
+        if (job.error) {
+            self->cover_errors.report("Error looking up cover thumbnail", *job.error);
+        }
+        if (job.target.empty()) {
+            return self->unlink_cover_art();
+        }
+        self->link_cover_art(job.target);
+    }
+
+    static void on_embedded_cover (EmbeddedCoverJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        // Superseded by a later track.
+        if (self->last_src.art_url != job.source) return;
+        if (job.stored) {
+            return self->link_cover_art(*job.stored);
+        }
+        if (job.error) {
+            self->cover_errors.report("Error extracting cover art", *job.error);
+        }
+        self->unlink_cover_art();
+    }
+
+    // Swapped in with a rename, so the bar never finds the cover missing.
+    void link_cover_art (const fs::path& target) {
+        fs::path link = cover_link_path();
+        fs::path tmp_link = link;
+        tmp_link += ".new";
+        std::error_code ec;
+        fs::remove(tmp_link, ec);
+        fs::create_symlink(target, tmp_link, ec);
+        if (!ec) fs::rename(tmp_link, link, ec);
+        auto linked = check_error_code(ec);
+        if (!linked) {
+            cover_errors.report("Error updating cover art", linked.error());
             return;
         }
-        refresh_waybar_image();
+        if (target.parent_path() == cover_store_dir()) schedule_cover_sweep();
+        if (config.cover_colors) update_palette(target);
+        if (!config.cover_in_output) {
+            return refresh_waybar_image();
+        }
+        auto version = publish_cover_version(target);
+        if (!version) {
+            return cover_errors.report("Error publishing cover art", version.error());
+        }
+        if (*version == cover_version) return;
+        retire_cover_version();
+        cover_version = std::move(*version);
+        display();
+    }
+
+    // Named after the target and the version of it, so a consumer reading the
+    // path from the stream sees every change without being signalled.
+    static Result<std::string> publish_cover_version (const fs::path& target) {
+        auto key = cover_version_key(target);
+        if (!key) return std::unexpected(key.error());
+        fs::path version = cover_versions_dir()/(*key + target.extension().string());
+        std::error_code ec;
+        fs::create_directories(version.parent_path(), ec);
+        if (!ec) fs::create_symlink(target, version, ec);
+        if (ec && ec != std::errc::file_exists) {
+            return std::unexpected(Error{version.string() + ": " + ec.message()});
+        }
+        return version.string();
+    }
+
+    // Until a new palette is ready the previous one stays.
+    void update_palette (const fs::path& image) {
+        auto key = cover_version_key(image);
+        if (!key) {
+            return set_palette({}, std::nullopt);
+        }
+        if (*key == palette_key) return;
+        auto cached = palettes.find(*key);
+        if (cached != palettes.end()) {
+            return set_palette(*key, cached->second);
+        }
+        if (!profile->decode_covers) {
+            return set_palette({}, std::nullopt);
+        }
+        palette_key = *key;
+        run_in_worker(worker_cancellable.get(), PaletteJob{image, *key}, on_palette, this);
+    }
+
+    static void on_palette (PaletteJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        if (job.error) {
+            self->cover_errors.report("Error computing cover colours", *job.error);
+        }
+        if (job.palette) {
+            if (self->palettes.size() >= max_palettes) self->palettes.clear();
+            self->palettes.emplace(job.key, *job.palette);
+        }
+        if (self->palette_key == job.key) self->set_palette(job.key, job.palette);
+    }
+
+    void set_palette (std::string key, std::optional<CoverPalette> palette) {
+        palette_key = std::move(key);
+        palette_open.clear();
+        palette_close.clear();
+        palette_classes.clear();
+        if (palette) {
+            std::array<char, 32> open;
+            std::snprintf(open.data(), open.size(), "<span foreground='#%06x'>", palette->accent);
+            palette_open = open.data();
+            palette_close = "</span>";
+            palette_classes = ",\"class\":[\"";
+            palette_classes.append(palette->dark() ? "cover-dark" : "cover-light");
+            palette_classes.append("\",\"cover-").append(palette->hue()).append("\"]");
+        }
+        display();
+    }
+
+    void retire_cover_version () {
+        if (cover_version.empty()) return;
+        retired_covers.emplace_back(std::move(cover_version), g_get_monotonic_time() + cover_grace_ms * 1000);
+        cover_version.clear();
+        schedule_cover_gc();
+    }
+
+    void schedule_cover_gc () {
+        if (cover_gc_timer != 0 || retired_covers.empty()) return;
+        cover_gc_timer = timer_wheel.schedule(cover_grace_ms, cover_grace_ms / 2, [this] {
+            cover_gc_timer = 0;
+            collect_cover_versions();
+        });
+    }
+
+    void collect_cover_versions () {
+        gint64 now = g_get_monotonic_time();
+        std::erase_if(retired_covers, [&](const auto& retired) {
+            if (retired.second > now) return false;
+            // The same version may have come back since.
+            if (retired.first != cover_version) {
+                std::error_code ec;
+                fs::remove(retired.first, ec);
+            }
+            return true;
+        });
+        schedule_cover_gc();
+    }
+
+    // Only covers we store add to the store, so only linking one arms the
+    // sweep; an idle bar does not wake up for it.
+    void schedule_cover_sweep () {
+        if (cover_sweep_timer != 0) return;
+        cover_sweep_timer = timer_wheel.schedule(cover_sweep_delay_ms, cover_sweep_delay_ms / 2, [this] {
+            cover_sweep_timer = 0;
+            std::error_code ec;
+            fs::path shown = fs::read_symlink(cover_link_path(), ec);
+            run_in_worker(worker_cancellable.get(), CoverStoreSweepJob{shown}, on_cover_store_swept, this);
+        });
+    }
+
+    static void on_cover_store_swept (CoverStoreSweepJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        if (job.error) {
+            self->cover_errors.report("Error sweeping the cover store", *job.error);
+        }
+    }
+
+    // Picks up the version a previous instance left in the restored frame and
+    // retires everything else it left behind.
+    void adopt_cover_versions () {
+        std::error_code ec;
+        fs::path target = fs::read_symlink(cover_link_path(), ec);
+        if (!ec) {
+            auto version = publish_cover_version(target);
+            if (version) cover_version = std::move(*version);
+        }
+        ec.clear();
+        for (fs::directory_iterator it{cover_versions_dir(), ec}; !ec && it != fs::directory_iterator{}; it.increment(ec)) {
+            if (it->path() == cover_version) continue;
+            retired_covers.emplace_back(it->path(), g_get_monotonic_time() + cover_grace_ms * 1000);
+        }
+        if (ec && ec != std::errc::no_such_file_or_directory) {
+            cover_errors.report("Error listing old cover versions", Error{cover_versions_dir().string() + ": " + ec.message()});
+        }
+        schedule_cover_gc();
     }
     
+    // Signals the image module (`"signal": 5`) of the waybar running us. The pid
+    // is looked up once, waybar outlives its modules.
     void refresh_waybar_image () {
-        int ret = std::system("pkill -RTMIN+5 waybar");
-        if (ret != 0) {
-            std::cerr << "Failed to send Waybar signal\n";
-        }
-    }
-
-    void update_to_display (const std::string& title, std::string_view artist) {
-        bool has_seperator = !title.empty() && !artist.empty();
-        to_display_utf8_len = 
-        g_utf8_strlen(title.data(), title.length()) + (has_seperator ? 3 : 0) + g_utf8_strlen(artist.data(), artist.length());
-        to_display.clear();
-        if (to_display_utf8_len <= max_width) {
-            needs_scrolling = false;
-            encode_into(to_display, title);
-            if (has_seperator) to_display.append(" ~ ");
-            encode_into(to_display, artist);
-        } else {
-            needs_scrolling = true;
-            to_display.append(title);
-            if (has_seperator) to_display.append(" ~ ");
-            to_display.append(artist);
+        if (waybar_pid == 0) waybar_pid = find_waybar_pid();
+        if (waybar_pid <= 0) {
+            waybar_pid = -1;
+            return cover_errors.report("Failed to send Waybar signal", Error{"not started by waybar"});
+        }
+        if (kill(waybar_pid, SIGRTMIN + 5) != 0) {
+            cover_errors.report("Failed to send Waybar signal", Error{std::strerror(errno)});
+        }
+    }
+
+    static TrackRenderer make_renderer () {
+        std::shared_ptr<FontMetrics> metrics = load_metrics();
+        size_t width = metrics ? config.pixel_width : max_width;
+        return {std::move(metrics), width, config.show_album};
+    }
+
+    void on_upcoming_tracks (const PlayerUID& player, std::vector<Metadata>&& tracks) override {
+        std::erase_if(tracks, [&](const Metadata& metadata) {
+            return track_cache.contains(TrackCache::key_for(player, metadata), metadata);
+        });
+        if (tracks.empty()) return;
+        PrefetchJob job{renderer, player, std::move(tracks), profile->decode_covers, config.cover_colors};
+        run_in_worker(worker_cancellable.get(), std::move(job), on_prefetched, this);
+    }
+
+    static void on_prefetched (PrefetchJob& job, gpointer data) {
+        auto self = static_cast<OutputGenerator*>(data);
+        for (size_t i = 0; i < job.rendered.size(); i++) {
+            self->track_cache.insert(TrackCache::key_for(job.player, job.tracks[i]), std::move(job.rendered[i]));
+        }
+        for (PrefetchedCover& cover : job.covers) {
+            if (self->prefetched_covers.size() >= max_prefetched_covers) self->prefetched_covers.clear();
+            self->prefetched_covers.insert_or_assign(std::move(cover.source), std::move(cover.target));
+            if (!cover.palette) continue;
+            if (self->palettes.size() >= max_palettes) self->palettes.clear();
+            self->palettes.emplace(std::move(cover.palette_key), *cover.palette);
+        }
+    }
+
+    static std::unique_ptr<FontMetrics> load_metrics () {
+        if (config.font_path.empty()) return nullptr;
+        auto loaded = FontMetrics::load(config.font_path, config.font_size_px);
+        if (!loaded) {
+            std::cerr << "Falling back to codepoint widths: " << loaded.error().message << "\n";
+            return nullptr;
         }
+        return std::move(*loaded);
+    }
+
+    uint64_t scroll_step_at (gint64 now_us) const {
+        if (now_us < scroll_epoch_us) return 0;
+        gint64 interval_us = static_cast<gint64>(profile->scroll_interval_ms) * 1000;
+        return static_cast<uint64_t>((now_us - scroll_epoch_us) / interval_us);
+    }
+
+    // Starts counting on the first interval boundary after `start_us`, a point in
+    // time every instance agrees on.
+    void anchor_scroll_epoch (gint64 start_us) {
+        scroll_anchor_us = start_us;
+        gint64 interval_us = static_cast<gint64>(profile->scroll_interval_ms) * 1000;
+        scroll_epoch_us = (start_us / interval_us + 1) * interval_us;
+        scroll_step = scroll_step_at(g_get_monotonic_time());
+    }
+
+    // Playerctl's cached position, extrapolated from the last Position it saw;
+    // reading it costs no D-Bus round trip. Zero when the player reports none.
+    static gint64 track_position (const Player& player) {
+        gint64 position = g_object_get<gint64>(player.get(), "position");
+        gint64 length = static_cast<gint64>(player.state.metadata.length);
+        if (position < 0 || (length > 0 && position > length)) return 0;
+        return position;
     }
 
     static constexpr std::string get_state_icons (PlayerctlPlaybackStatus status) {
@@ -753,79 +4430,218 @@ struct OutputGenerator : ManagedPlayerHandler {
         }
     }
 
-    static std::string_view utf8_substr(const std::string& str, glong start, glong length) {
-        const char* begin = g_utf8_offset_to_pointer(str.c_str(), start);
-        const char* end   = g_utf8_offset_to_pointer(begin, length);
-        return {begin, end};
+    // The scroll tick only runs while something on screen scrolls and the bar can
+    // be seen, so a track that fits the bar costs no wakeups at all.
+    void update_scrolling () {
+        if (suspended || !shown_layout().scrolling) {
+            timer_wheel.cancel(scroll_timer);
+            scroll_timer = 0;
+            return;
+        }
+        if (scroll_timer != 0) return;
+        scroll_timer = timer_wheel.schedule_periodic(profile->scroll_interval_ms, scroll_tolerance_ms, [this] {
+            scoll();
+        }, true);
     }
 
+    void on_session_active (bool active) override {
+        if (suspended == !active) return;
+        suspended = !active;
+        update_scrolling();
+        if (suspended) {
+            timer_wheel.cancel(lyric_timer);
+            lyric_timer = 0;
+            return;
+        }
+        // One catch-up frame for everything that changed in the meantime, shown
+        // by update_lyric_line already if the line moved on.
+        size_t shown_line = lyric_line;
+        if (config.lyrics) update_lyric_line();
+        if (lyric_line == shown_line) display();
+    }
 
-    void display () {
-        std::cout << "{\"text\":\"" + std::string{!is_playing ? "<i>" : ""};
+    // Only timers change, everything already rendered stays valid. The epoch is
+    // re-derived from the same start for the new interval, so every instance
+    // lands on the same step.
+    void on_battery_changed (bool on_battery) override {
+        profile = on_battery ? &config.battery_profile : &config.ac_profile;
+        anchor_scroll_epoch(scroll_anchor_us);
+        timer_wheel.cancel(scroll_timer);
+        scroll_timer = 0;
+        update_scrolling();
+    }
 
-        if (!needs_scrolling) {
-            std::cout << to_display;
-        } else {
-            constexpr char seperator[] = " ~ ";
-            if (display_offset < to_display_utf8_len) {
-                size_t remaining = to_display_utf8_len - display_offset;
-                if (remaining >= max_width) {
-                    std::cout << EscapedString(utf8_substr(to_display, display_offset, max_width));
-                } else {
-                    std::cout << EscapedString(utf8_substr(to_display, display_offset, remaining));
-                    size_t left_over = max_width - remaining;
-                    if (left_over <= 3) {
-                        std::cout << EscapedString({seperator, left_over});
-                    } else {
-                        const char* start = to_display.c_str();
-                        const char* end = g_utf8_offset_to_pointer(start, left_over - 3);
-                        std::cout << " ~ " << EscapedString({start, end});
-                    }
-                }
-            } else {
-                auto sperator_offset = display_offset - to_display_utf8_len;
-                if (sperator_offset > 2) {
-                    display_offset = 0;
-                    const char* end = g_utf8_offset_to_pointer(to_display.c_str(), max_width);
-                    std::cout << EscapedString({to_display.c_str(), end});
-                } else {
-                    size_t seperator_size = 3 - sperator_offset;
-                    const char* end = g_utf8_offset_to_pointer(to_display.c_str(), max_width - seperator_size);
-                    std::cout << std::string_view{seperator + sperator_offset, seperator_size} << EscapedString({to_display.c_str(), end});
-                }
-            }
+    void display () {
+        if (suspended) return;
+        const ScrollLayout& layout = shown_layout();
+        if (layout.empty()) {
+            frame.assign("{\"text\":\"\"}\n");
+            std::cout.write(frame.data(), frame.size());
+            std::cout.flush();
+            return;
         }
-
-        std::cout << std::string{!is_playing ? "</i>" : ""} + "\"}\n";
+        frame.assign("{\"text\":\"");
+        frame.append(palette_open);
+        if (!is_playing) frame.append("<i>");
+        layout.render(frame, scroll_step);
+        if (!is_playing) frame.append("</i>");
+        frame.append(palette_close);
+        if (config.cover_in_output) {
+            frame.append("\",\"cover\":\"");
+            json_escape_into(frame, cover_version);
+        }
+        frame.push_back('"');
+        frame.append(palette_classes);
+        frame.append("}\n");
+        std::cout.write(frame.data(), frame.size());
         std::cout.flush();
     }
 
     void scoll () {
-        if (!needs_scrolling) return;
-        display_offset++;
+        if (!shown_layout().scrolling) return;
+        uint64_t step = scroll_step_at(g_get_monotonic_time());
+        if (step == scroll_step) return;
+        scroll_step = step;
         display();
     }
+};
 
-    static gboolean sroll_callback(gpointer self) {
-        static_cast<OutputGenerator*>(self)->scoll();
-        return true;
+static std::string format_duration (gint64 ms) {
+    gint64 seconds = ms / 1000;
+    std::array<char, 32> text;
+    if (seconds >= 3600) {
+        std::snprintf(text.data(), text.size(), "%lld:%02lld:%02lld", static_cast<long long>(seconds / 3600), static_cast<long long>(seconds / 60 % 60), static_cast<long long>(seconds % 60));
+    } else {
+        std::snprintf(text.data(), text.size(), "%lld:%02lld", static_cast<long long>(seconds / 60), static_cast<long long>(seconds % 60));
     }
-};
+    return text.data();
+}
+
+// `mpris history [--days=N] [--top]`: what was listened to in the last N days
+// (default 7), oldest first, or with --top the tracks listened to the longest.
+static int query_history (int argc, char** argv) {
+    guint days = 7;
+    bool top = false;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--top") {
+            top = true;
+            continue;
+        }
+        if (parse_uint_option(arg, "--days", days)) continue;
+        std::cerr << "Usage: mpris history [--days=N] [--top]\n";
+        return EXIT_FAILURE;
+    }
+    gint64 since = g_get_real_time() / G_USEC_PER_SEC - static_cast<gint64>(days) * 24 * 60 * 60;
+
+    std::vector<HistoryEntry> entries;
+    fs::path path = history_path();
+    fs::path rotated = path;
+    rotated += ".1";
+    for (const fs::path& log : {rotated, path}) {
+        auto file = MappedFile::open(log.string());
+        if (!file) continue;
+        std::string_view bytes = (*file)->bytes;
+        while (!bytes.empty()) {
+            size_t eol = bytes.find('\n');
+            std::string_view line = bytes.substr(0, eol);
+            bytes.remove_prefix(eol == std::string_view::npos ? bytes.size() : eol + 1);
+            auto entry = parse_history_entry(line);
+            if (entry && entry->started >= since) entries.push_back(std::move(*entry));
+        }
+    }
+    // Batches of concurrent instances may land out of order.
+    std::ranges::stable_sort(entries, {}, &HistoryEntry::started);
+
+    if (top) {
+        struct Total {
+            std::string_view artist;
+            std::string_view title;
+            gint64 listened_ms = 0;
+            size_t plays = 0;
+        };
+        std::unordered_map<std::string, Total> totals;
+        for (const HistoryEntry& entry : entries) {
+            Total& total = totals[entry.artist + '\0' + entry.title];
+            total.artist = entry.artist;
+            total.title = entry.title;
+            total.listened_ms += entry.listened_ms;
+            total.plays++;
+        }
+        std::vector<const Total*> ranked;
+        for (const auto& [key, total] : totals) ranked.push_back(&total);
+        std::ranges::sort(ranked, std::ranges::greater{}, &Total::listened_ms);
+        for (const Total* total : ranked) {
+            std::cout << format_duration(total->listened_ms) << "  " << total->plays << "x  "
+            << total->artist << " - " << total->title << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (const HistoryEntry& entry : entries) {
+        time_t started = static_cast<time_t>(entry.started);
+        struct tm local;
+        std::array<char, 32> when;
+        localtime_r(&started, &local);
+        std::strftime(when.data(), when.size(), "%Y-%m-%d %H:%M", &local);
+        std::cout << when.data() << "  " << format_duration(entry.listened_ms);
+        if (entry.length_ms > 0) std::cout << "/" << format_duration(entry.length_ms);
+        std::cout << "  " << entry.artist << " - " << entry.title;
+        if (!entry.album.empty()) std::cout << " [" << entry.album << "]";
+        std::cout << " (" << entry.player << ")\n";
+    }
+    return EXIT_SUCCESS;
+}
 
+// The harnesses under tests/ include this file and bring their own entry point.
+#ifndef MPRIS_NO_MAIN
 int main (int argc, char** argv) {
+    if (argc > 1 && std::string_view{argv[1]} == "history") {
+        return query_history(argc - 1, argv + 1);
+    }
     // display_print("Listening for players...");
-    std::atexit(exit_handler);
-    std::signal(SIGINT , [](int) { exit_handler(); });
-    std::signal(SIGABRT, [](int) { exit_handler(); });
-    std::signal(SIGTERM, [](int) { exit_handler(); });
+    // Inherited blocked from a hot upgrade, or blocked here for a fresh start,
+    // until every handler below is in place.
+    block_main_loop_signals(true);
+    // Lets the kernel batch our remaining timeouts (GLib's poll) with other wakeups.
+    prctl(PR_SET_TIMERSLACK, TimerWheel::tick_us * 1000, 0, 0, 0);
+    main_loop.reset(g_main_loop_new(nullptr, FALSE));
+    g_unix_signal_add(SIGINT, on_terminate_signal, nullptr);
+    g_unix_signal_add(SIGTERM, on_terminate_signal, nullptr);
+    parse_args(argc, argv);
+    if (g_mkdir_with_parents(instance_dir().c_str(), 0700) != 0) {
+        std::cerr << "Cannot create " << instance_dir() << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    std::error_code ec;
+    self_exe = fs::read_symlink("/proc/self/exe", ec);
+    if (ec) self_exe = argv[0];
+    self_argv = argv;
     OutputGenerator output_generator;
+    if (output_generator.manager.empty()) {
+        return EXIT_FAILURE;
+    }
+    g_unix_signal_add(SIGUSR1, +[](gpointer data) -> gboolean {
+        static_cast<OutputGenerator*>(data)->manager.report_event_rates(std::cerr);
+        std::cerr << "timer wheel: " << timer_wheel.wakeups_per_minute() << " wakeups/min, "
+        << timer_wheel.size() << " timers\n";
+        const TrackCache& cache = static_cast<OutputGenerator*>(data)->track_cache;
+        std::cerr << "track cache: " << cache.hits << " hits, " << cache.misses << " misses\n";
+        static_cast<OutputGenerator*>(data)->track_change_hits.report(std::cerr, "track change (cached)");
+        static_cast<OutputGenerator*>(data)->track_change_misses.report(std::cerr, "track change (rendered)");
+        return G_SOURCE_CONTINUE;
+    }, &output_generator);
+    g_unix_signal_add(SIGHUP, +[](gpointer data) -> gboolean {
+        static_cast<OutputGenerator*>(data)->hot_upgrade();
+        return G_SOURCE_CONTINUE;
+    }, &output_generator);
+    block_main_loop_signals(false);
 
-    
-    g_timeout_add(100, OutputGenerator::sroll_callback, &output_generator);
+    timer_wheel.attach();
 
-    main_loop = g_main_loop_new(nullptr, FALSE);
-    g_main_loop_run(main_loop);
+    g_main_loop_run(main_loop.get());
+    output_generator.shutdown();
 
-    g_main_loop_unref(main_loop);
     return 0;
 }
+#endif
@@ -0,0 +1,48 @@
+// Embedded cover lookup over a music library, as EmbeddedCoverJob runs it per
+// track: map the file, find the picture, touch its bytes. Run it twice to see
+// both a cold and a warm page cache.
+// Usage: cover_scan DIRECTORY
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+#include "samples.h"
+
+int main (int argc, char** argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: cover_scan DIRECTORY\n");
+        return EXIT_FAILURE;
+    }
+    Samples with_cover;
+    Samples without_cover;
+    size_t files = 0;
+    uintmax_t file_bytes = 0;
+    size_t picture_bytes = 0;
+    std::error_code ec;
+    fs::recursive_directory_iterator it{argv[1], fs::directory_options::skip_permission_denied, ec};
+    for (; !ec && it != fs::recursive_directory_iterator{}; it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        std::error_code entry_ec;
+        if (!entry.is_regular_file(entry_ec)) continue;
+        std::string extension = entry.path().extension().string();
+        if (extension != ".flac" && extension != ".mp3" && extension != ".m4a" && extension != ".opus" && extension != ".ogg") continue;
+        files++;
+        file_bytes += entry.file_size(entry_ec);
+        bool found = false;
+        auto start = std::chrono::steady_clock::now();
+        auto cover = read_embedded_cover(entry.path().string());
+        if (cover && *cover) {
+            std::string_view picture = (*cover)->data();
+            // Fault the picture in, like hashing it for the cover store would.
+            volatile char sink = 0;
+            for (size_t i = 0; i < picture.size(); i += 4096) sink = sink + picture[i];
+            picture_bytes += picture.size();
+            found = true;
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        (found ? with_cover : without_cover).us.push_back(us);
+    }
+    if (ec) std::fprintf(stderr, "Stopped early: %s\n", ec.message().c_str());
+    std::printf("%zu files, %.1f MiB, %.1f MiB of pictures\n", files, file_bytes / 1048576.0, picture_bytes / 1048576.0);
+    with_cover.report("with embedded cover");
+    without_cover.report("without embedded cover");
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Palette extraction from large covers, as PaletteJob runs it on the worker.
+// Without arguments a 3000x3000 JPEG of gradients and noise is generated.
+// Usage: palette [runs] [cover.jpg...]
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+#include "samples.h"
+
+static Result<fs::path> generate_cover (int size) {
+    GHandle<GdkPixbuf> pixbuf{gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, size, size)};
+    guchar* pixels = gdk_pixbuf_get_pixels(pixbuf.get());
+    int stride = gdk_pixbuf_get_rowstride(pixbuf.get());
+    uint32_t noise = 1;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            noise = noise * 1664525 + 1013904223;
+            guchar* pixel = pixels + y * stride + x * 3;
+            pixel[0] = static_cast<guchar>(x * 255 / size);
+            pixel[1] = static_cast<guchar>(y * 255 / size ^ (noise >> 28));
+            pixel[2] = static_cast<guchar>((x + y) % 256);
+        }
+    }
+    fs::path path = fs::temp_directory_path()/"mpris-palette-bench.jpg";
+    std::array<char*, 2> keys{const_cast<char*>("quality"), nullptr};
+    std::array<char*, 2> values{const_cast<char*>("90"), nullptr};
+    auto saved = handle_gfunc(gdk_pixbuf_savev, pixbuf.get(), path.c_str(), "jpeg", keys.data(), values.data());
+    if (!saved) return std::unexpected(saved.error());
+    return path;
+}
+
+int main (int argc, char** argv) {
+    int runs = argc > 1 ? std::atoi(argv[1]) : 20;
+    std::vector<fs::path> covers{argv + std::min(argc, 2), argv + argc};
+    if (covers.empty()) {
+        auto generated = generate_cover(3000);
+        if (!generated) {
+            std::fprintf(stderr, "%s\n", generated.error().message.c_str());
+            return EXIT_FAILURE;
+        }
+        covers.push_back(*generated);
+    }
+    for (const fs::path& cover : covers) {
+        Samples samples;
+        std::optional<CoverPalette> palette;
+        for (int i = 0; i < runs; i++) {
+            samples.time([&] {
+                auto computed = compute_palette(cover);
+                if (computed) palette = *computed;
+            });
+        }
+        samples.report(cover.filename().c_str());
+        if (palette) std::printf("  dominant #%06x accent #%06x\n", palette->dominant, palette->accent);
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+// Timing samples of one benchmarked operation, reported as percentiles.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+struct Samples {
+    std::vector<double> us;
+
+    template <typename F>
+    void time (F&& operation) {
+        auto start = std::chrono::steady_clock::now();
+        operation();
+        us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    void report (const char* name) {
+        if (us.empty()) return;
+        std::ranges::sort(us);
+        auto at = [&](double q) { return us[static_cast<size_t>(q * static_cast<double>(us.size() - 1))]; };
+        std::printf("%-28s n=%-6zu p50 %10.2f us  p99 %10.2f us  max %10.2f us\n", name, us.size(), at(0.5), at(0.99), us.back());
+    }
+};
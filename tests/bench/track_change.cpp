@@ -0,0 +1,89 @@
+// Cost of a track change on the main loop, without and with prefetch. Without,
+// the track is rendered on the spot (bidi, escaping, layout); with, it is the
+// cache lookup the prefetcher leaves behind, which renders the next tracks
+// ahead of time like TrackListPrefetcher does.
+// Usage: track_change [tracks] [font.ttf font-size-px pixel-width]
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+#include "samples.h"
+
+// Deterministic titles of mixed scripts and lengths, most of them long enough to scroll.
+static std::vector<Metadata> synthetic_tracks (size_t count) {
+    static constexpr std::string_view words[] = {
+        "Symphony", "No.", "9", "in", "D", "minor", "Op.", "125", "&", "<Live>",
+        "夜に駆ける", "東京", "שיר", "השירים", "أغنية", "الليل", "Café", "Déjà", "Vu", "Ω",
+    };
+    std::vector<Metadata> tracks;
+    uint32_t state = 12345;
+    auto next = [&] { state = state * 1664525 + 1013904223; return state >> 8; };
+    for (size_t i = 0; i < count; i++) {
+        auto phrase = [&](size_t length) {
+            std::string text;
+            for (size_t w = 0; w < length; w++) {
+                if (w > 0) text.push_back(' ');
+                text.append(words[next() % std::size(words)]);
+            }
+            return text;
+        };
+        Metadata track;
+        track.trackid = "/org/mpris/MediaPlayer2/Track/" + std::to_string(i);
+        track.title = phrase(2 + next() % 10);
+        track.artist = phrase(1 + next() % 4);
+        track.album = phrase(1 + next() % 6);
+        track.url = "file:///music/" + std::to_string(i) + ".flac";
+        tracks.push_back(std::move(track));
+    }
+    return tracks;
+}
+
+int main (int argc, char** argv) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    TrackRenderer renderer{nullptr, 50, true};
+    if (argc > 4) {
+        auto metrics = FontMetrics::load(argv[2], static_cast<guint>(std::atoi(argv[3])));
+        if (!metrics) {
+            std::fprintf(stderr, "%s\n", metrics.error().message.c_str());
+            return EXIT_FAILURE;
+        }
+        renderer = {std::move(*metrics), static_cast<size_t>(std::atoi(argv[4])), true};
+    }
+    std::vector<Metadata> tracks = synthetic_tracks(count);
+    PlayerUID player{"bench", PLAYERCTL_SOURCE_DBUS_SESSION};
+    constexpr size_t lookahead = 3;
+
+    Samples without_prefetch;
+    TrackCache cold;
+    for (const Metadata& track : tracks) {
+        without_prefetch.time([&] {
+            auto key = TrackCache::key_for(player, track);
+            auto rendered = cold.find(key, track);
+            if (!rendered) {
+                rendered = renderer.render(track);
+                cold.insert(std::move(key), rendered);
+            }
+        });
+    }
+
+    Samples with_prefetch;
+    TrackCache warm;
+    for (size_t i = 0; i < tracks.size(); i++) {
+        // Done by the worker between track changes, not timed.
+        for (size_t k = i; k < std::min(tracks.size(), i + 1 + lookahead); k++) {
+            auto key = TrackCache::key_for(player, tracks[k]);
+            if (!warm.contains(key, tracks[k])) warm.insert(std::move(key), renderer.render(tracks[k]));
+        }
+        with_prefetch.time([&] {
+            auto key = TrackCache::key_for(player, tracks[i]);
+            auto rendered = warm.find(key, tracks[i]);
+            if (!rendered) {
+                rendered = renderer.render(tracks[i]);
+                warm.insert(std::move(key), rendered);
+            }
+        });
+    }
+
+    without_prefetch.report("track change, no prefetch");
+    with_prefetch.report("track change, prefetched");
+    std::printf("prefetched cache: %zu hits, %zu misses\n", warm.hits, warm.misses);
+    return 0;
+}
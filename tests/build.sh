@@ -0,0 +1,18 @@
+#!/bin/sh
+# Builds the libFuzzer targets in tests/fuzz and the benchmarks in tests/bench
+# into tests/out. Run a fuzz target with its corpus, e.g.
+#   tests/out/utf8_sanitize tests/fuzz/corpus/utf8_sanitize
+set -e
+cd "$(dirname "$0")"
+mkdir -p out
+flags="-std=gnu++23 -g -O1 -fsanitize=fuzzer,address,undefined"
+libs="playerctl freetype2 fribidi gdk-pixbuf-2.0"
+clang++ $flags $(pkg-config --cflags --libs $libs) fuzz/utf8_sanitize.cpp -o out/utf8_sanitize
+clang++ $flags $(pkg-config --cflags --libs $libs json-glib-1.0 pango) fuzz/markup_escape.cpp -o out/markup_escape
+clang++ $flags $(pkg-config --cflags --libs $libs) fuzz/embedded_tags.cpp -o out/embedded_tags
+
+# Benchmarks, optimized like the real build.
+bench_flags="-std=gnu++23 -O3"
+clang++ $bench_flags $(pkg-config --cflags --libs $libs) bench/track_change.cpp -o out/track_change
+clang++ $bench_flags $(pkg-config --cflags --libs $libs) bench/palette.cpp -o out/palette
+clang++ $bench_flags $(pkg-config --cflags --libs $libs) bench/cover_scan.cpp -o out/cover_scan
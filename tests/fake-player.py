@@ -0,0 +1,167 @@
+# A stand-in MPRIS player for the test scripts, on whatever session bus
+# $DBUS_SESSION_BUS_ADDRESS names. While storming it emits PropertiesChanged
+# about RATE times a second, cycling through a few tracks and toggling
+# pause; SIGUSR1 ends the storm and settles on a playing track titled FINAL,
+# SIGHUP likewise on one titled LONG, too long for the bar, and SIGUSR2 starts
+# the storm again.
+# With --calm it starts out settled, on a track titled TITLE (default FINAL).
+# Needs PyGObject.
+# Usage: python3 tests/fake-player.py [--rate=HZ] [--final=TITLE] [--long=TITLE] [--calm] [--title=TITLE]
+import signal, sys
+from gi.repository import Gio, GLib
+
+INTERFACES = '''
+<node>
+  <interface name="org.mpris.MediaPlayer2">
+    <method name="Raise"/>
+    <method name="Quit"/>
+    <property name="CanQuit" type="b" access="read"/>
+    <property name="CanRaise" type="b" access="read"/>
+    <property name="HasTrackList" type="b" access="read"/>
+    <property name="Identity" type="s" access="read"/>
+    <property name="SupportedUriSchemes" type="as" access="read"/>
+    <property name="SupportedMimeTypes" type="as" access="read"/>
+  </interface>
+  <interface name="org.mpris.MediaPlayer2.Player">
+    <method name="Next"/>
+    <method name="Previous"/>
+    <method name="Pause"/>
+    <method name="PlayPause"/>
+    <method name="Stop"/>
+    <method name="Play"/>
+    <method name="Seek"><arg name="Offset" type="x" direction="in"/></method>
+    <method name="SetPosition">
+      <arg name="TrackId" type="o" direction="in"/>
+      <arg name="Position" type="x" direction="in"/>
+    </method>
+    <method name="OpenUri"><arg name="Uri" type="s" direction="in"/></method>
+    <signal name="Seeked"><arg name="Position" type="x"/></signal>
+    <property name="PlaybackStatus" type="s" access="read"/>
+    <property name="LoopStatus" type="s" access="read"/>
+    <property name="Rate" type="d" access="read"/>
+    <property name="Shuffle" type="b" access="read"/>
+    <property name="Metadata" type="a{sv}" access="read"/>
+    <property name="Volume" type="d" access="read"/>
+    <property name="Position" type="x" access="read"/>
+    <property name="MinimumRate" type="d" access="read"/>
+    <property name="MaximumRate" type="d" access="read"/>
+    <property name="CanGoNext" type="b" access="read"/>
+    <property name="CanGoPrevious" type="b" access="read"/>
+    <property name="CanPlay" type="b" access="read"/>
+    <property name="CanPause" type="b" access="read"/>
+    <property name="CanSeek" type="b" access="read"/>
+    <property name="CanControl" type="b" access="read"/>
+  </interface>
+</node>
+'''
+PATH = '/org/mpris/MediaPlayer2'
+PLAYER = 'org.mpris.MediaPlayer2.Player'
+
+options = dict(arg[2:].split('=', 1) if '=' in arg else (arg[2:], '') for arg in sys.argv[1:])
+rate = int(options.get('rate', 1000))
+final = options.get('final', 'Calm')
+long = options.get('long', 'A title far too long to fit in the bar, so it has to scroll')
+storming = 'calm' not in options
+storm_source = 0
+
+tracks = ['Storm %d' % n for n in range(8)]
+state = {'track': 0, 'title': options.get('title', final), 'status': 'Playing', 'tick': 0}
+
+
+def metadata():
+    return GLib.Variant('a{sv}', {
+        'mpris:trackid': GLib.Variant('o', '/org/mpris/MediaPlayer2/Track/%d' % state['track']),
+        'mpris:length': GLib.Variant('x', 180 * 1000 * 1000),
+        'xesam:title': GLib.Variant('s', state['title']),
+        'xesam:artist': GLib.Variant('as', ['Fake']),
+    })
+
+
+def player_property(name):
+    values = {
+        'PlaybackStatus': GLib.Variant('s', state['status']),
+        'LoopStatus': GLib.Variant('s', 'None'),
+        'Rate': GLib.Variant('d', 1.0),
+        'Shuffle': GLib.Variant('b', False),
+        'Metadata': metadata(),
+        'Volume': GLib.Variant('d', 1.0),
+        'Position': GLib.Variant('x', 0),
+        'MinimumRate': GLib.Variant('d', 1.0),
+        'MaximumRate': GLib.Variant('d', 1.0),
+    }
+    return values.get(name, GLib.Variant('b', True))
+
+
+def root_property(name):
+    return {
+        'CanQuit': GLib.Variant('b', False),
+        'CanRaise': GLib.Variant('b', False),
+        'HasTrackList': GLib.Variant('b', False),
+        'Identity': GLib.Variant('s', 'Fake player'),
+        'SupportedUriSchemes': GLib.Variant('as', []),
+        'SupportedMimeTypes': GLib.Variant('as', []),
+    }[name]
+
+
+def get_property(connection, sender, path, interface, name):
+    return player_property(name) if interface == PLAYER else root_property(name)
+
+
+def method_call(connection, sender, path, interface, method, parameters, invocation):
+    invocation.return_value(None)
+
+
+def emit_changed(connection, names):
+    changed = {name: player_property(name) for name in names}
+    connection.emit_signal(None, PATH, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                           GLib.Variant('(sa{sv}as)', (PLAYER, changed, [])))
+
+
+# Every tick moves to the next track, every seventh also flips between
+# playing and paused, so both track changes and state changes are stormed.
+def storm_tick(connection):
+    state['tick'] += 1
+    state['track'] = state['tick'] % len(tracks)
+    state['title'] = tracks[state['track']]
+    names = ['Metadata']
+    if state['tick'] % 7 == 0:
+        state['status'] = 'Paused' if state['status'] == 'Playing' else 'Playing'
+        names.append('PlaybackStatus')
+    emit_changed(connection, names)
+    return GLib.SOURCE_CONTINUE
+
+
+def start_storm(connection):
+    global storming, storm_source
+    storming = True
+    if storm_source == 0:
+        storm_source = GLib.timeout_add(max(1, 1000 // rate), storm_tick, connection)
+    return GLib.SOURCE_CONTINUE
+
+
+def settle(connection, title):
+    global storming, storm_source
+    storming = False
+    if storm_source != 0:
+        GLib.source_remove(storm_source)
+        storm_source = 0
+    state.update(track=len(tracks) + (title == long), title=title, status='Playing')
+    emit_changed(connection, ['Metadata', 'PlaybackStatus'])
+    return GLib.SOURCE_CONTINUE
+
+
+def on_bus(connection, name):
+    for interface in Gio.DBusNodeInfo.new_for_xml(INTERFACES).interfaces:
+        connection.register_object(PATH, interface, method_call, get_property, None)
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGUSR1, lambda: settle(connection, final))
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGHUP, lambda: settle(connection, long))
+    GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGUSR2, lambda: start_storm(connection))
+    if storming:
+        start_storm(connection)
+
+
+Gio.bus_own_name(Gio.BusType.SESSION, 'org.mpris.MediaPlayer2.fakeplayer',
+                 Gio.BusNameOwnerFlags.NONE, on_bus, None, None)
+GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGTERM, lambda: loop.quit())
+loop = GLib.MainLoop()
+loop.run()
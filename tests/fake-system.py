@@ -0,0 +1,61 @@
+# Stand-ins for logind and UPower, on whatever system bus
+# $DBUS_SYSTEM_BUS_ADDRESS names: the user's graphical session with IdleHint
+# and LockedHint, and UPower's OnBattery, all false at start. SIGUSR1 toggles
+# LockedHint, SIGHUP IdleHint and SIGUSR2 OnBattery, each announced with
+# PropertiesChanged like the real services do.
+# Needs PyGObject. Usage: python3 tests/fake-system.py
+import signal
+from gi.repository import Gio, GLib
+
+INTERFACES = '''
+<node>
+  <interface name="org.freedesktop.login1.User">
+    <property name="Display" type="(so)" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.login1.Session">
+    <property name="Active" type="b" access="read"/>
+    <property name="IdleHint" type="b" access="read"/>
+    <property name="LockedHint" type="b" access="read"/>
+  </interface>
+  <interface name="org.freedesktop.UPower">
+    <property name="OnBattery" type="b" access="read"/>
+  </interface>
+</node>
+'''
+USER_PATH = '/org/freedesktop/login1/user/self'
+SESSION_PATH = '/org/freedesktop/login1/session/c1'
+UPOWER_PATH = '/org/freedesktop/UPower'
+SESSION = 'org.freedesktop.login1.Session'
+UPOWER = 'org.freedesktop.UPower'
+
+state = {'Active': True, 'IdleHint': False, 'LockedHint': False, 'OnBattery': False}
+
+
+def get_property(connection, sender, path, interface, name):
+    if name == 'Display':
+        return GLib.Variant('(so)', ('c1', SESSION_PATH))
+    return GLib.Variant('b', state[name])
+
+
+def toggle(path, interface, name):
+    state[name] = not state[name]
+    connection.emit_signal(None, path, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                           GLib.Variant('(sa{sv}as)', (interface, {name: GLib.Variant('b', state[name])}, [])))
+    print('%s=%s' % (name, str(state[name]).lower()), flush=True)
+    return GLib.SOURCE_CONTINUE
+
+
+interfaces = {info.name: info for info in Gio.DBusNodeInfo.new_for_xml(INTERFACES).interfaces}
+connection = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+for path, name in [(USER_PATH, 'org.freedesktop.login1.User'), (SESSION_PATH, SESSION), (UPOWER_PATH, UPOWER)]:
+    connection.register_object(path, interfaces[name], None, get_property, None)
+# The objects are in place before the names appear, so nobody sees them empty.
+for name in ['org.freedesktop.login1', 'org.freedesktop.UPower']:
+    Gio.bus_own_name_on_connection(connection, name, Gio.BusNameOwnerFlags.NONE, None, None)
+
+GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGUSR1, lambda: toggle(SESSION_PATH, SESSION, 'LockedHint'))
+GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGHUP, lambda: toggle(SESSION_PATH, SESSION, 'IdleHint'))
+GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGUSR2, lambda: toggle(UPOWER_PATH, UPOWER, 'OnBattery'))
+loop = GLib.MainLoop()
+GLib.unix_signal_add(GLib.PRIORITY_DEFAULT, signal.SIGTERM, lambda: loop.quit())
+loop.run()
@@ -0,0 +1,51 @@
+// Fuzz target for the tag readers that run over arbitrary local files: embedded
+// pictures (FLAC, ID3v2, MP4, Ogg) and lyrics (LRC, SYLT, USLT, LYRICS comments).
+// Each reader first runs directly on libFuzzer's exactly sized buffer, so
+// AddressSanitizer catches any read past the end, then the whole path runs
+// through a memfd the way a real file is mapped.
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+#include <sys/mman.h>
+
+static bool within (std::string_view part, std::string_view whole) {
+    return part.empty() || (part.data() >= whole.data() && part.data() + part.size() <= whole.data() + whole.size());
+}
+
+static void check_lyrics (const Lyrics& lyrics) {
+    assert(std::ranges::is_sorted(lyrics.lines, {}, &Lyrics::Line::start_us));
+    for (const auto& line : lyrics.lines) {
+        assert(line.start_us >= 0);
+        // Like metadata, lyrics may keep NUL, which the escape table replaces.
+        std::string text = line.text;
+        std::ranges::replace(text, '\0', ' ');
+        assert(g_utf8_validate(text.data(), static_cast<gssize>(text.size()), nullptr));
+    }
+    if (!lyrics.lines.empty()) {
+        assert(lyrics.line_at(lyrics.lines.front().start_us - 1) == Lyrics::none);
+        assert(lyrics.line_at(lyrics.lines.back().start_us) == lyrics.lines.size() - 1);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t* data, size_t size) {
+    std::string_view bytes{reinterpret_cast<const char*>(data), size};
+
+    assert(within(flac_picture(bytes), bytes));
+    assert(within(id3_picture(bytes), bytes));
+    assert(within(mp4_picture(bytes), bytes));
+    ogg_picture(bytes);
+    check_lyrics(parse_lrc(bytes));
+    if (auto lyrics = tag_lyrics(bytes)) check_lyrics(*lyrics);
+
+    int fd = memfd_create("embedded-tags", MFD_CLOEXEC);
+    if (fd < 0 || write_all(fd, bytes).has_value() == false) std::abort();
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    auto cover = read_embedded_cover(path);
+    if (cover && *cover) {
+        std::string_view picture = (*cover)->data();
+        assert(!picture.empty());
+        assert(!(*cover)->decoded.empty() || within(picture, (*cover)->file->bytes));
+    }
+    if (auto lyrics = load_lyrics(path)) check_lyrics(*lyrics);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,83 @@
+# Writes the seed corpus of the embedded_tags fuzz target: small well-formed
+# files of every supported format, and variants with truncated data and with
+# frame, block and box lengths far beyond the file.
+# Usage: python3 tests/fuzz/make_embedded_tags_corpus.py tests/fuzz/corpus/embedded_tags
+import struct, base64, os, sys
+out = sys.argv[1]
+os.makedirs(out, exist_ok=True)
+PNG = b'\x89PNG\r\n\x1a\n' + b'\x00\x00\x00\x0dIHDR' + b'\x00'*17
+def w(name, data): open(os.path.join(out, name), 'wb').write(data)
+
+def flac_picture_body(data=PNG, mime=b'image/png', mime_len=None, data_len=None):
+    return (struct.pack('>II', 3, len(mime) if mime_len is None else mime_len) + mime +
+            struct.pack('>I', 0) + struct.pack('>IIII', 1, 1, 24, 0) +
+            struct.pack('>I', len(data) if data_len is None else data_len) + data)
+def vorbis_comments(comments):
+    b = struct.pack('<I', 3) + b'enc' + struct.pack('<I', len(comments))
+    for c in comments: b += struct.pack('<I', len(c)) + c
+    return b
+def flac_block(t, body, last=False, length=None):
+    n = len(body) if length is None else length
+    return bytes([(0x80 if last else 0) | t]) + n.to_bytes(3, 'big') + body
+LRC = b'[ar:x]\n[offset:+100]\n[00:01.00][00:03.50]one\r\n[00:02.123]two\n[99:59.999]last\n'
+flac = b'fLaC' + flac_block(0, b'\0'*34) + flac_block(4, vorbis_comments([b'TITLE=t', b'LYRICS=' + LRC])) + flac_block(6, flac_picture_body(), last=True) + b'\xff\xf8audio'
+w('flac_picture_lyrics', flac)
+w('flac_truncated_picture', flac[:len(flac) - 30])
+w('flac_block_oversized', b'fLaC' + flac_block(6, flac_picture_body(), last=True, length=0xFFFFFF))
+w('flac_picture_data_oversized', b'fLaC' + flac_block(6, flac_picture_body(data_len=0xFFFFFFF0), last=True))
+w('flac_picture_mime_oversized', b'fLaC' + flac_block(6, flac_picture_body(mime_len=0xFFFFFFFF), last=True))
+w('flac_comment_count_oversized', b'fLaC' + flac_block(4, struct.pack('<I', 3) + b'enc' + struct.pack('<I', 0xFFFFFFFF) + struct.pack('<I', 0x7FFFFFFF) + b'LYRICS=', last=True))
+
+def syncsafe(n): return bytes([(n >> 21) & 0x7F, (n >> 14) & 0x7F, (n >> 7) & 0x7F, n & 0x7F])
+def id3(frames, major=3, size=None):
+    body = b''.join(frames)
+    return b'ID3' + bytes([major, 0, 0]) + syncsafe(len(body) if size is None else size) + body
+def frame(fid, body, major=3, size=None):
+    n = len(body) if size is None else size
+    return fid + (syncsafe(n) if major == 4 else struct.pack('>I', n)) + b'\0\0' + body
+apic = b'\x00image/png\x00\x03desc\x00' + PNG
+sylt = b'\x00eng\x02\x01desc\x00' + b'first\x00' + struct.pack('>I', 1000) + b'\nsecond\x00' + struct.pack('>I', 2500)
+sylt16 = b'\x01eng\x02\x01' + 'd'.encode('utf-16') + b'\0\0' + 'שלום'.encode('utf-16') + b'\0\0' + struct.pack('>I', 500)
+uslt = b'\x03eng\x00' + LRC
+mp3 = id3([frame(b'APIC', apic), frame(b'SYLT', sylt), frame(b'USLT', uslt)]) + b'\xff\xfbaudio'
+w('id3v23_apic_sylt_uslt', mp3)
+w('id3v24_apic_sylt_utf16', id3([frame(b'APIC', apic, 4), frame(b'SYLT', sylt16, 4)], major=4))
+w('id3_truncated_apic', mp3[:30])
+w('id3_tag_oversized', id3([frame(b'APIC', apic)], size=0x0FFFFFFF))
+w('id3_frame_oversized', id3([frame(b'APIC', apic, size=0x7FFFFFFF)]))
+w('id3_sylt_unterminated', id3([frame(b'SYLT', b'\x00eng\x02\x01desc\x00text without end')]))
+w('id3_sylt_missing_time', id3([frame(b'SYLT', b'\x00eng\x02\x01\x00line\x00\x00\x00')]))
+w('id3_uslt_utf16_odd', id3([frame(b'USLT', b'\x01eng\xff\xfe\x00\x00' + b'[00:01]x'.decode().encode('utf-16-le') + b'\x41')]))
+w('id3v22_pic', b'ID3\x02\x00\x00' + syncsafe(6 + 6 + len(PNG)) + b'PIC' + (6 + len(PNG)).to_bytes(3, 'big') + b'\x00PNG\x03\x00' + PNG)
+
+def box(t, body, size=None): return struct.pack('>I', len(body) + 8 if size is None else size) + t + body
+covr = box(b'covr', box(b'data', struct.pack('>II', 14, 0) + PNG))
+m4a = box(b'ftyp', b'M4A \0\0\0\0') + box(b'moov', box(b'udta', box(b'meta', b'\0\0\0\0' + box(b'hdlr', b'\0'*25) + box(b'ilst', covr))))
+w('mp4_covr', m4a)
+w('mp4_truncated_covr', m4a[:len(m4a) - 10])
+w('mp4_box_oversized', box(b'ftyp', b'M4A ') + box(b'moov', box(b'udta', b''), size=0xFFFFFFFF))
+w('mp4_box_size_zero', box(b'ftyp', b'M4A ') + box(b'moov', b'', size=0))
+w('mp4_largesize', box(b'ftyp', b'M4A ') + struct.pack('>I', 1) + b'moov' + struct.pack('>Q', 0xFFFFFFFFFFFFFFFF))
+w('mp4_box_undersized', box(b'ftyp', b'M4A ') + box(b'moov', b'\0' * 8, size=4))
+
+def ogg_pages(packet, serial=1, segment_limit=None):
+    pages = b''; seq = 0
+    while True:
+        chunk = packet[:255 * 255]; packet = packet[len(chunk):]
+        lacing = [255] * (len(chunk) // 255) + ([len(chunk) % 255] if len(chunk) % 255 or not packet else [])
+        if segment_limit is not None: lacing = lacing[:segment_limit]
+        header = b'OggS\0' + bytes([0 if seq == 0 else 1]) + b'\0' * 8 + struct.pack('<II', serial, seq + 1) + b'\0\0\0\0' + bytes([len(lacing)]) + bytes(lacing)
+        pages += header + chunk; seq += 1
+        if not packet: return pages
+picture = base64.b64encode(flac_picture_body())
+opus_tags = b'OpusTags' + vorbis_comments([b'METADATA_BLOCK_PICTURE=' + picture, b'LYRICS=' + LRC])
+opus_head = b'OggS\0\x02' + b'\0' * 8 + struct.pack('<II', 1, 0) + b'\0\0\0\0\x01\x13' + b'OpusHead\x01\x02' + b'\0' * 9
+opus = opus_head + ogg_pages(opus_tags)
+w('opus_picture_lyrics', opus)
+w('opus_truncated', opus[:len(opus) - 20])
+w('opus_lacing_truncated', opus_head + ogg_pages(opus_tags, segment_limit=1)[:60])
+w('opus_picture_not_base64', opus_head + ogg_pages(b'OpusTags' + vorbis_comments([b'METADATA_BLOCK_PICTURE=***not base64***'])))
+w('opus_multipage_picture', opus_head + ogg_pages(b'OpusTags' + vorbis_comments([b'METADATA_BLOCK_PICTURE=' + base64.b64encode(flac_picture_body(PNG + b'\0' * 70000))])))
+w('vorbis_comment', b'OggS\0\x02' + b'\0' * 8 + struct.pack('<II', 2, 0) + b'\0\0\0\0\x01\x1e' + b'\x01vorbis' + b'\0' * 23 + ogg_pages(b'\x03vorbis' + vorbis_comments([b'LYRICS=' + LRC]) + b'\x01', serial=2))
+w('lrc_plain', LRC + b'[00:05]\n[1:02:33]colons\n[00:07:5]short fraction\n[xx:yy]bad\n[00:01.5')
+w('empty', b'')
@@ -0,0 +1,82 @@
+// Fuzz target for the combined markup + JSON escaping: every frame the layout
+// can produce must parse as JSON, and its text as Pango markup. For static text
+// the markup must also round-trip to the sanitized input.
+//
+// Input: one byte of width budget, then up to three fields separated by NUL.
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+#include <json-glib/json-glib.h>
+#include <pango/pango.h>
+
+// The text Pango should recover: control characters other than newline, tab
+// and carriage return become U+FFFD, and GMarkup normalizes line endings to \n.
+static std::string expected_plain (std::string_view sanitized) {
+    std::string plain;
+    for (size_t i = 0; i < sanitized.size(); i++) {
+        char c = sanitized[i];
+        if (c == '\r') {
+            plain.push_back('\n');
+            if (i + 1 < sanitized.size() && sanitized[i + 1] == '\n') i++;
+        } else if (static_cast<unsigned char>(c) < 0x20 && c != '\n' && c != '\t') {
+            plain.append("\xEF\xBF\xBD");
+        } else {
+            plain.push_back(c);
+        }
+    }
+    return plain;
+}
+
+// Parses `frame` as the module's JSON line and returns the plain text of its markup.
+static std::string parse_frame (const std::string& frame) {
+    GHandle<JsonParser> parser{json_parser_new()};
+    GError* error = nullptr;
+    if (!json_parser_load_from_data(parser.get(), frame.data(), static_cast<gssize>(frame.size()), &error)) {
+        std::fprintf(stderr, "invalid JSON: %s\n%s\n", error->message, frame.c_str());
+        std::abort();
+    }
+    JsonObject* object = json_node_get_object(json_parser_get_root(parser.get()));
+    const gchar* markup = json_object_get_string_member(object, "text");
+    gchar* plain = nullptr;
+    if (!pango_parse_markup(markup, -1, 0, nullptr, &plain, nullptr, &error)) {
+        std::fprintf(stderr, "invalid markup: %s\n%s\n", error->message, markup);
+        std::abort();
+    }
+    GHandle<gchar> owned{plain};
+    return plain;
+}
+
+static std::string frame_of (std::string_view markup) {
+    return std::string{"{\"text\":\"<i>"}.append(markup).append("</i>\"}");
+}
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t* data, size_t size) {
+    if (size == 0) return 0;
+    size_t max_width = data[0] % 64 + 1;
+    std::string_view rest{reinterpret_cast<const char*>(data) + 1, size - 1};
+
+    std::vector<std::string> fields;
+    while (fields.size() < 3) {
+        size_t end = rest.find('\0');
+        fields.push_back(sanitized_utf8(std::string{rest.substr(0, end)}));
+        if (end == std::string_view::npos) break;
+        rest.remove_prefix(end + 1);
+    }
+
+    for (const std::string& field : fields) {
+        std::string markup;
+        encode_into(markup, field);
+        std::string plain = parse_frame(frame_of(markup));
+        assert(plain == expected_plain(field));
+    }
+
+    ScrollLayout layout;
+    layout.build({fields.begin(), fields.end()}, max_width);
+    size_t steps = 1;
+    for (const auto& segment : layout.segments) steps = std::max(steps, segment.cycle);
+    for (uint64_t step = 0; step < std::min<size_t>(steps, 256); step++) {
+        std::string markup;
+        layout.render(markup, step);
+        parse_frame(frame_of(markup));
+    }
+    return 0;
+}
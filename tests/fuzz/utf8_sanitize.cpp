@@ -0,0 +1,51 @@
+// Differential fuzz target: sanitize_utf8 against GLib's g_utf8_make_valid.
+//
+// GLib replaces every byte of an ill-formed sequence with its own U+FFFD, while
+// sanitize_utf8 replaces the maximal ill-formed subpart with one, so runs of
+// U+FFFD are collapsed before comparing. GLib also treats NUL as invalid,
+// sanitize_utf8 keeps it as ASCII; NULs are mapped to 0x01 for the comparison.
+#define MPRIS_NO_MAIN
+#include "../../mpris.cpp"
+
+static std::string collapse_replacements (std::string_view str) {
+    constexpr std::string_view replacement = "\xEF\xBF\xBD";
+    std::string collapsed;
+    while (!str.empty()) {
+        if (str.starts_with(replacement)) {
+            if (!std::string_view{collapsed}.ends_with(replacement)) collapsed.append(replacement);
+            str.remove_prefix(replacement.size());
+            continue;
+        }
+        collapsed.push_back(str.front());
+        str.remove_prefix(1);
+    }
+    return collapsed;
+}
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t* data, size_t size) {
+    std::string input{reinterpret_cast<const char*>(data), size};
+
+    // Valid input must come back byte for byte.
+    std::string sanitized = input;
+    sanitize_utf8(sanitized);
+    if (g_utf8_validate(input.data(), static_cast<gssize>(input.size()), nullptr)) {
+        assert(sanitized == input);
+    }
+
+    std::string without_nul = input;
+    std::ranges::replace(without_nul, '\0', '\x01');
+    std::string ours = without_nul;
+    sanitize_utf8(ours);
+    assert(g_utf8_validate(ours.data(), static_cast<gssize>(ours.size()), nullptr));
+    GHandle<gchar> theirs{g_utf8_make_valid(without_nul.data(), static_cast<gssize>(without_nul.size()))};
+    assert(collapse_replacements(ours) == collapse_replacements(theirs.get()));
+
+    // The SIMD prefix scan must agree with a byte loop at every offset.
+    auto bytes = reinterpret_cast<const unsigned char*>(input.data());
+    for (size_t offset = 0; offset < std::min<size_t>(size, 32); offset++) {
+        size_t expected = 0;
+        while (offset + expected < size && bytes[offset + expected] < 0x80) expected++;
+        assert(ascii_prefix_length(bytes + offset, size - offset) == expected);
+    }
+    return 0;
+}
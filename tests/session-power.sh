@@ -0,0 +1,96 @@
+#!/bin/sh
+# Runs mpris against tests/fake-system.py, a stand-in for logind and UPower on
+# a private system bus, and tests/fake-player.py on a private session bus:
+#   locked, idle  no frames while the session is locked or idle, however busy
+#                 the player, then exactly one catch-up frame showing its
+#                 final track once the session is back
+#   on battery    a scrolling title steps at the battery interval while
+#                 UPower reports OnBattery, and at the AC one again after
+# Needs dbus-daemon and PyGObject. Usage: tests/session-power.sh [path/to/mpris]
+exe=${1:-./mpris}
+ac_ms=100
+battery_ms=500
+final=Calm
+dir=$(dirname "$0")
+log=$(mktemp)
+out=$(mktemp)
+
+# Two buses, or playerctl would find the fake player on both of them.
+session_bus=$(dbus-daemon --session --fork --print-address=1 --print-pid=1)
+system_bus=$(dbus-daemon --session --fork --print-address=1 --print-pid=1)
+export DBUS_SESSION_BUS_ADDRESS="$(echo "$session_bus" | sed -n 1p)"
+export DBUS_SYSTEM_BUS_ADDRESS="$(echo "$system_bus" | sed -n 1p)"
+python3 "$dir/fake-system.py" >/dev/null &
+system=$!
+python3 "$dir/fake-player.py" --calm --title=Start --final=$final &
+player=$!
+trap 'kill $player $system; kill "$(echo "$session_bus" | sed -n 2p)" "$(echo "$system_bus" | sed -n 2p)"; rm -f "$log" "$out"' EXIT
+
+fail () {
+    echo "FAIL: $1"
+    cat "$log"
+    exit 1
+}
+
+frames () {
+    wc -l <"$out"
+}
+
+# The stand-ins must own their names first: the monitors do not wait for them.
+sleep 1
+"$exe" --instance=session-power --scroll-interval=$ac_ms --battery-scroll-interval=$battery_ms >"$out" 2>"$log" &
+pid=$!
+sleep 1
+kill -0 $pid 2>/dev/null || fail "did not start"
+
+# Hides the session with signal $1 to the stand-in, storms the player while it
+# is hidden and settles it on the final track, then shows the session again
+# with the same signal.
+hide_and_show () {
+    kill -$1 $system
+    sleep 1
+    before=$(frames)
+    kill -USR2 $player
+    sleep 1
+    kill -USR1 $player
+    sleep 1
+    hidden=$(($(frames) - before))
+    [ $hidden -eq 0 ] || fail "$2: $hidden frames while hidden"
+    kill -$1 $system
+    sleep 1
+    shown=$(($(frames) - before))
+    [ $shown -eq 1 ] || fail "$2: $shown frames after showing, not one"
+    tail -n 1 "$out" | grep -q "$final" || fail "$2: catch-up frame is not the final track: $(tail -n 1 "$out")"
+    echo "ok: $2, one catch-up frame"
+}
+
+# Prints the frames written in the next two seconds.
+count_frames () {
+    before=$(frames)
+    sleep 2
+    echo $(($(frames) - before))
+}
+
+hide_and_show USR1 "locked"
+hide_and_show HUP "idle"
+
+# At 100 ms a scrolling title writes 20 frames in two seconds, at 500 ms 4;
+# the bounds leave room for a loaded machine.
+kill -HUP $player
+sleep 1
+ac=$(count_frames)
+[ $ac -ge 15 ] || fail "on AC: $ac frames in 2 s"
+kill -USR2 $system
+sleep 1
+battery=$(count_frames)
+[ $battery -ge 2 ] && [ $battery -le 6 ] || fail "on battery: $battery frames in 2 s"
+kill -USR2 $system
+sleep 1
+back=$(count_frames)
+[ $back -ge 15 ] || fail "back on AC: $back frames in 2 s"
+echo "ok: $ac, $battery and $back frames in 2 s on AC, battery and AC again"
+
+kill -TERM $pid
+wait $pid
+status=$?
+[ $status -eq 0 ] || fail "exit status $status"
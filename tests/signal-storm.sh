@@ -0,0 +1,90 @@
+#!/bin/sh
+# Floods a running mpris with signals while a fake player floods it with
+# PropertiesChanged at about 1 kHz, on a private session bus. SIGHUP (hot
+# upgrade, same pid) and SIGUSR1 must leave it running and, once the player
+# settles, showing the player's final track; a storm of SIGTERM mixed with
+# SIGHUP and SIGUSR1 must end it with status 0 before the shutdown deadline,
+# its output ending in a complete line.
+# Needs dbus-daemon and PyGObject. Usage: tests/signal-storm.sh [path/to/mpris] [rounds]
+exe=${1:-./mpris}
+rounds=${2:-200}
+deadline_ms=2000
+final=Calm
+dir=$(dirname "$0")
+log=$(mktemp)
+out=$(mktemp)
+
+bus=$(dbus-daemon --session --fork --print-address=1 --print-pid=1)
+export DBUS_SESSION_BUS_ADDRESS="$(echo "$bus" | sed -n 1p)"
+python3 "$dir/fake-player.py" --rate=1000 --final=$final &
+player=$!
+trap 'kill $player; kill "$(echo "$bus" | sed -n 2p)"; rm -f "$log" "$out"' EXIT
+
+fail () {
+    echo "FAIL: $1"
+    cat "$log"
+    exit 1
+}
+
+start_mpris () {
+    : >"$out"
+    "$exe" --instance=signal-storm >"$out" 2>>"$log" &
+    pid=$!
+    sleep 1
+    kill -0 $pid 2>/dev/null || fail "did not start"
+}
+
+now_ms () {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Ends the player's storm and checks that the bar caught up with it.
+settle () {
+    kill -USR1 $player
+    sleep 1
+    kill -0 $pid 2>/dev/null || fail "$1: died"
+    tail -n 1 "$out" | grep -q "$final" || fail "$1: last frame is not the final track: $(tail -n 1 "$out")"
+    echo "ok: $1, showing the final track"
+    kill -USR2 $player
+}
+
+# Ends the storm with SIGTERM and checks for a clean exit within the deadline.
+terminate () {
+    start=$(now_ms)
+    # An exited but unreaped child still accepts signals, so the storm is bounded.
+    i=0
+    while [ $i -lt 100 ]; do
+        kill -TERM $pid 2>/dev/null
+        kill -HUP $pid 2>/dev/null
+        kill -USR1 $pid 2>/dev/null
+        i=$((i + 1))
+    done
+    wait $pid
+    status=$?
+    elapsed=$(($(now_ms) - start))
+    [ $status -eq 0 ] || fail "$1: exit status $status"
+    [ $elapsed -le $deadline_ms ] || fail "$1: took ${elapsed} ms to exit"
+    [ "$(tail -c 2 "$out")" = "}" ] || fail "$1: output ends in a partial line"
+    echo "ok: $1, exited in ${elapsed} ms"
+}
+
+start_mpris
+i=0
+while [ $i -lt "$rounds" ]; do
+    kill -HUP $pid 2>/dev/null || fail "died during SIGHUP/SIGUSR1 storm (round $i)"
+    kill -USR1 $pid 2>/dev/null || fail "died during SIGHUP/SIGUSR1 storm (round $i)"
+    i=$((i + 1))
+done
+sleep 1
+kill -0 $pid 2>/dev/null || fail "died after SIGHUP/SIGUSR1 storm"
+settle "$rounds upgrades during a PropertiesChanged storm"
+terminate "SIGTERM after $rounds upgrades"
+
+# SIGTERM landing in the middle of upgrades and player events.
+start_mpris
+i=0
+while [ $i -lt 20 ]; do
+    kill -HUP $pid 2>/dev/null
+    i=$((i + 1))
+done
+terminate "SIGTERM during upgrades"
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Measures wakeups per minute of mpris in three scenarios and prints them as a
+# Markdown table:
+#   idle       no players, on a private session bus
+#   paused     PLAYER paused
+#   scrolling  PLAYER playing a track whose title is too long for the bar
+# "all threads" counts voluntary context switches of every live thread (worker
+# threads that exit take theirs along), "timer wheel" is mpris' own SIGUSR1
+# figure since start.
+# Usage: tests/wakeups.sh path/to/mpris PLAYER [seconds]
+usage="usage: tests/wakeups.sh path/to/mpris PLAYER [seconds]"
+exe=${1:?$usage}
+player=${2:?$usage}
+seconds=${3:-60}
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+switches () {
+    cat /proc/"$1"/task/*/status 2>/dev/null | awk '/^voluntary_ctxt_switches/ { n += $2 } END { print n + 0 }'
+}
+
+# Runs mpris for the scenario named $1 and prints its row.
+measure () {
+    "$exe" --instance=wakeups >/dev/null 2>"$log" &
+    pid=$!
+    sleep 2
+    before=$(switches $pid)
+    sleep "$seconds"
+    after=$(switches $pid)
+    kill -USR1 $pid
+    sleep 1
+    timer=$(sed -n 's/^timer wheel: \([0-9.]*\) wakeups\/min.*/\1/p' "$log" | tail -n 1)
+    kill -TERM $pid
+    wait $pid
+    printf '| %s | %s | %s |\n' "$1" $(((after - before) * 60 / seconds)) "${timer:-?}"
+}
+
+echo "| scenario | all threads /min | timer wheel /min |"
+echo "|---|---|---|"
+
+session_bus=$DBUS_SESSION_BUS_ADDRESS
+bus=$(dbus-daemon --session --fork --print-address=1 --print-pid=1)
+export DBUS_SESSION_BUS_ADDRESS="$(echo "$bus" | sed -n 1p)"
+measure idle
+kill "$(echo "$bus" | sed -n 2p)"
+export DBUS_SESSION_BUS_ADDRESS="$session_bus"
+
+playerctl -p "$player" pause
+measure paused
+playerctl -p "$player" play
+measure scrolling